@@ -0,0 +1,234 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "compress.h"
+
+/* A sequence is a token byte holding the literal and match lengths,
+ * extra length bytes for the literals, the literals, a little endian
+ * 16-bit match offset and extra length bytes for the match. The last
+ * sequence has literals only. */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 /* the last bytes are always literals */
+#define MATCH_LIMIT 12 /* no match starts this close to the end */
+#define MAX_OFFSET 65535
+#define RUN_MASK 15
+#define HASH_LOG 12
+
+static inline uint32_t
+read_uint32 (const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+  return v;
+}
+
+static inline uint32_t
+hash_uint32 (uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static bool
+write_length (uint8_t **op, uint8_t *oend, size_t length)
+{
+  for (length -= RUN_MASK; length >= 255; length -= 255)
+    {
+      if (*op >= oend)
+        return false;
+      *(*op)++ = 255;
+    }
+
+  if (*op >= oend)
+    return false;
+  *(*op)++ = length;
+
+  return true;
+}
+
+/* Write a sequence. Without a match (offset 0) it is the last one. */
+static bool
+write_sequence (uint8_t **op, uint8_t *oend, const uint8_t *literals,
+  size_t nliterals, size_t offset, size_t match)
+{
+  uint8_t *token = *op;
+
+  if (*op >= oend)
+    return false;
+  (*op)++;
+
+  *token = (nliterals < RUN_MASK ? nliterals : RUN_MASK) << 4;
+  if (nliterals >= RUN_MASK && !write_length (op, oend, nliterals))
+    return false;
+
+  if ((size_t)(oend - *op) < nliterals)
+    return false;
+  memcpy (*op, literals, nliterals);
+  *op += nliterals;
+
+  if (offset == 0)
+    return true;
+
+  if (oend - *op < 2)
+    return false;
+  *(*op)++ = offset & 0xff;
+  *(*op)++ = offset >> 8;
+
+  match -= MIN_MATCH;
+  *token |= match < RUN_MASK ? match : RUN_MASK;
+  if (match >= RUN_MASK && !write_length (op, oend, match))
+    return false;
+
+  return true;
+}
+
+size_t
+compress_block (const uint8_t *src, size_t size,
+  uint8_t *dst, size_t capacity)
+{
+  uint32_t table[1 << HASH_LOG];
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + size;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + capacity;
+
+  memset (table, 0, sizeof table);
+
+  if (size > MATCH_LIMIT)
+    {
+      const uint8_t *ilimit = end - MATCH_LIMIT;
+      const uint8_t *mlimit = end - LAST_LITERALS;
+
+      while (ip < ilimit)
+        {
+          uint32_t seq = read_uint32 (ip);
+          uint32_t h = hash_uint32 (seq);
+          const uint8_t *ref = src + table[h];
+          const uint8_t *m;
+
+          table[h] = ip - src;
+
+          if (ref >= ip || ip - ref > MAX_OFFSET || read_uint32 (ref) != seq)
+            {
+              ip++;
+              continue;
+            }
+
+          for (m = ip + MIN_MATCH, ref += MIN_MATCH;
+               m < mlimit && *m == *ref; m++, ref++)
+            ;
+
+          if (!write_sequence (&op, oend, anchor, ip - anchor,
+                               m - ref, m - ip))
+            return 0;
+
+          ip = anchor = m;
+        }
+    }
+
+  if (!write_sequence (&op, oend, anchor, end - anchor, 0, 0))
+    return 0;
+
+  return op - dst;
+}
+
+static bool
+read_length (const uint8_t **ip, const uint8_t *iend, size_t *length)
+{
+  uint8_t b;
+
+  do
+    {
+      if (*ip >= iend)
+        return false;
+      b = *(*ip)++;
+      *length += b;
+    }
+  while (b == 255);
+
+  return true;
+}
+
+ssize_t
+decompress_block (const uint8_t *src, size_t size,
+  uint8_t *dst, size_t capacity)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + size;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + capacity;
+
+  while (ip < iend)
+    {
+      uint8_t token = *ip++;
+      size_t length = token >> 4;
+      size_t offset;
+      const uint8_t *match;
+
+      if (length == RUN_MASK && !read_length (&ip, iend, &length))
+        return -1;
+      if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+        return -1;
+
+      memcpy (op, ip, length);
+      op += length;
+      ip += length;
+
+      /* The last sequence has no match */
+      if (ip == iend || op == oend)
+        break;
+
+      if (iend - ip < 2)
+        return -1;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > (size_t)(op - dst))
+        return -1;
+
+      length = token & RUN_MASK;
+      if (length == RUN_MASK && !read_length (&ip, iend, &length))
+        return -1;
+      length += MIN_MATCH;
+      if (length > (size_t)(oend - op))
+        return -1;
+
+      /* The match may overlap the bytes it produces */
+      match = op - offset;
+      if (offset >= length)
+        {
+          memcpy (op, match, length);
+          op += length;
+        }
+      else
+        {
+          while (length-- > 0)
+            *op++ = *match++;
+        }
+    }
+
+  return op - dst;
+}
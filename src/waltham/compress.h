@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Fast LZ77 compression of message bodies, in the LZ4 block format */
+
+/* Largest compressed size of size bytes */
+#define COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+/* Returns the compressed size, or 0 if it does not fit in capacity */
+size_t compress_block (const uint8_t *src, size_t size,
+  uint8_t *dst, size_t capacity);
+
+/* Returns the decompressed size, or -1 on malformed input or if it does
+ * not fit in capacity. Stops once capacity bytes have been produced, so
+ * the input may be followed by padding. */
+ssize_t decompress_block (const uint8_t *src, size_t size,
+  uint8_t *dst, size_t capacity);
+
+#endif
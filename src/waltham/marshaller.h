@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -37,40 +38,7 @@
 
 #include "message.h"
 #include "marshaller_log.h"
-
-static inline int send_all (int sock, const struct iovec *iov, int iovcnt)
-{
-   int ret;
-
-   do {
-      ret = writev (sock, iov, iovcnt);
-   } while (ret == -1 && errno == EINTR);
-
-   return ret;
-}
-
-static inline int recv_all (int sock, struct iovec *iov, int iovcnt)
-{
-   ssize_t ret;
-
-   do {
-      ret = readv (sock, iov, iovcnt);
-
-      while (ret > 0) {
-         if ((size_t) ret < iov[0].iov_len) {
-            iov[0].iov_base = ((uint8_t *) iov[0].iov_base) + ret;
-            iov[0].iov_len -= ret;
-            break;
-         }
-         ret -= iov[0].iov_len;
-         iov++;
-         iovcnt--;
-      }
-
-   } while ((ret == -1 && errno == EINTR) || iovcnt > 0);
-
-   return ret;
-}
+#include "waltham-private.h"
 
 #define ABORT_CALL_NR() { \
    ABORT_TIMING(""); \
@@ -85,111 +53,112 @@ static inline int recv_all (int sock, struct iovec *iov, int iovcnt)
 #define PADDED(sz) \
    (((sz) + 3) & ~3)
 
-#define START_MESSAGE(name, sz, opcode) \
+/* Messages are encoded straight into the connection's output buffer.
+ * wth_connection_reserve_message() hands out sz contiguous bytes, which
+ * are always 4-byte aligned as every message size is a multiple of 4. */
+
+static inline uint8_t *
+serialize_uint32 (uint8_t *p, uint32_t val)
+{
+   memcpy (p, &val, sizeof val);
+   return p + sizeof val;
+}
+
+static inline uint8_t *
+serialize_bytes (uint8_t *p, const void *data, uint32_t sz)
+{
+   uint32_t padding = PADDED (sz) - sz;
+
+   p = serialize_uint32 (p, sz);
+   memcpy (p, data, sz);
+   p += sz;
+   memset (p, 0, padding);
+
+   return p + padding;
+}
+
+/* The data is sent from outside the output buffer, only the length
+ * prefix and padding go into it */
+static inline uint8_t *
+serialize_reference (struct wth_connection *conn,
+                     enum message_priority priority, size_t size,
+                     uint8_t *start, uint8_t *p,
+                     const void *data, uint32_t sz)
+{
+   uint32_t padding = PADDED (sz) - sz;
+
+   p = serialize_uint32 (p, sz);
+   if (wth_connection_add_external (conn, priority, size, p - start,
+                                    data, sz))
+     return p;
+   memset (p, 0, padding);
+
+   return p + padding;
+}
+
+#define START_MESSAGE(conn, name, sz, opcode, priority) \
+   START_MESSAGE_EXTERNAL(conn, name, sz, 0, opcode, priority)
+
+/* external: bytes of the message sent from outside the output buffer.
+ * sz may exceed the 16-bit header field, such messages are split into
+ * frames on commit. */
+#define START_MESSAGE_EXTERNAL(conn, name, sz, external, opcode, priority) \
    const char *msg_name __attribute__((unused)) = name; \
-   hdr_t hdr = { 0, sz, opcode, 0 }; \
-   int send_ret; \
-   struct iovec marshaller_params[16]; \
-   int marshaller_paramid = 1; \
-   int param_padding __attribute__((unused)) = 0; \
-   marshaller_params[0].iov_base = (void *) &hdr; \
-   marshaller_params[0].iov_len = sizeof(hdr_t); \
-   DEBUG_STAMP (); \
-   STREAM_DEBUG ((unsigned char *) &hdr, sizeof (hdr), "header -> ");
+   size_t msg_size = sz; \
+   enum message_priority msg_priority = priority; \
+   uint8_t *msg_start = wth_connection_reserve_message (conn, \
+                                                        msg_size - (external), \
+                                                        msg_size, \
+                                                        msg_priority); \
+   uint8_t *msg_p = msg_start; \
+   if (msg_start == NULL) \
+      goto message_dropped; \
+   { \
+      hdr_t hdr = { 0, (unsigned short) msg_size, opcode, 0 }; \
+      memcpy (msg_p, &hdr, sizeof hdr); \
+      msg_p += sizeof hdr; \
+   }
 
 #define END_MESSAGE(conn) \
-   send_ret = send_all (wth_connection_get_fd(conn), marshaller_params, marshaller_paramid); \
-   if (send_ret == -1) \
-      exit (errno); \
-   DEBUG_TYPE(msg_name);
-
-#define ADD_PADDING(sz) \
-   param_padding = (4 - ((sz) & 3)) & 3; \
-   if (param_padding > 0) { \
-      marshaller_params[marshaller_paramid].iov_base = (void *) &marshaller_paramid; \
-      marshaller_params[marshaller_paramid].iov_len = param_padding; \
-      marshaller_paramid++; \
-   }
+   TRACE_MESSAGE (msg_name, msg_start, msg_p - msg_start); \
+   wth_connection_commit_message (conn, msg_p - msg_start, msg_size, \
+                                  msg_priority); \
+message_dropped:
 
-#define SERIALIZE_PARAM(param, sz) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) param; \
-   marshaller_params[marshaller_paramid].iov_len = sz; \
-   marshaller_paramid++; \
-   ADD_PADDING (sz); \
-   STREAM_DEBUG ((unsigned char *) param, sz, "param  -> ");
+/* For messages that may replace an unsent one with the same key */
+#define END_MESSAGE_COALESCE(conn, key) \
+   TRACE_MESSAGE (msg_name, msg_start, msg_p - msg_start); \
+   wth_connection_commit_coalescible (conn, msg_p - msg_start, msg_size, \
+                                      msg_priority, (uint32_t) (key)); \
+message_dropped:
 
-#define SERIALIZE_PARAM_SILENT(param, sz) \
-   marshaller_params[marshaller_paramid].iov_base = param; \
-   marshaller_params[marshaller_paramid].iov_len = sz; \
-   marshaller_paramid++; \
-   ADD_PADDING (sz); \
-   STREAM_DEBUG_DATA (param, sz);
+#define DATA_EXTERNAL_SIZE(conn, sz) \
+   wth_connection_external_size (conn, sz)
 
-#define SERIALIZE_DATA(data, sz) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) &sz; \
-   marshaller_params[marshaller_paramid].iov_len = sizeof (int); \
-   marshaller_paramid++; \
-   STREAM_DEBUG ((unsigned char *) &sz, sizeof (int), "data sz   -> "); \
-   marshaller_params[marshaller_paramid].iov_base = data; \
-   marshaller_params[marshaller_paramid].iov_len = sz; \
-   marshaller_paramid++; \
-   ADD_PADDING (sz); \
-   STREAM_DEBUG ((unsigned char *) data, sz, "data   -> ");
+/* All scalar protocol types are 32 bits wide, no padding needed */
+#define SERIALIZE_PARAM(param) \
+   msg_p = serialize_uint32 (msg_p, (uint32_t) (param));
 
-#define SERIALIZE_ARRAY(array) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) &array->size; \
-   marshaller_params[marshaller_paramid].iov_len = sizeof (size_t); \
-   marshaller_paramid++; \
-   STREAM_DEBUG ((unsigned char *) &sz, sizeof (int), "array sz  -> "); \
-   marshaller_params[marshaller_paramid].iov_base = array->data; \
-   marshaller_params[marshaller_paramid].iov_len = array->size; \
-   marshaller_paramid++; \
-   ADD_PADDING (array->size); \
-   STREAM_DEBUG ((unsigned char *) array->data, array->size, "array  -> ");
-
-#define FLUSH_RECV() \
-   if (marshaller_paramid > 0) { \
-      int recv_ret; \
-      recv_ret = recv_all (marshaller_get_fd (), marshaller_params, marshaller_paramid); \
-      if (recv_ret == -1) \
-         exit (errno); \
-      marshaller_paramid = 0; \
-   }
+#define SERIALIZE_OBJECT(obj) \
+   msg_p = serialize_uint32 (msg_p, \
+      (obj) ? ((struct wth_object *) (obj))->id : 0);
 
-#define SKIP_PADDING(sz) \
-   param_padding = (4 - ((sz) & 3)) & 3; \
-   if (param_padding > 0) { \
-      marshaller_params[marshaller_paramid].iov_base = (void *) &padding_buffer; \
-      marshaller_params[marshaller_paramid].iov_len = param_padding; \
-      marshaller_paramid++; \
-   }
+#define SERIALIZE_DATA(data, sz) \
+   msg_p = serialize_bytes (msg_p, data, sz);
 
-#define DESERIALIZE_PARAM(param, sz) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) param; \
-   marshaller_params[marshaller_paramid].iov_len = sz; \
-   marshaller_paramid++; \
-   SKIP_PADDING(sz);
-
-#define DESERIALIZE_PARAM_SILENT(param, sz) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) param; \
-   marshaller_params[marshaller_paramid].iov_len = sz; \
-   marshaller_paramid++; \
-   SKIP_PADDING(sz);
-
-#define DESERIALIZE_DATA(data) \
-   marshaller_params[marshaller_paramid].iov_base = (void *) &data_sz; \
-   marshaller_params[marshaller_paramid].iov_len = sizeof (data_sz); \
-   marshaller_paramid++; \
-   FLUSH_RECV(); \
-   if (data_sz > 0) { \
-      DESERIALIZE_PARAM (data, data_sz) \
-   }
+#define SERIALIZE_DATA_EXTERNAL(conn, data, sz, external) \
+   if (external) \
+      msg_p = serialize_reference (conn, msg_priority, msg_size, \
+                                   msg_start, msg_p, data, sz); \
+   else \
+      msg_p = serialize_bytes (msg_p, data, sz);
 
-#define DESERIALIZE_OPTIONAL_PARAM(param, sz) \
-   if (param) { \
-      DESERIALIZE_PARAM (param, sz); \
-   } else { \
-      DESERIALIZE_PARAM (recv_buffer, sz); \
-   }
+/* File descriptors take no room in the message, they are passed with
+ * SCM_RIGHTS and received in the order of the messages */
+#define SERIALIZE_FD(conn, fd) \
+   wth_connection_add_fd (conn, msg_priority, msg_size, fd);
+
+#define SERIALIZE_ARRAY(array) \
+   msg_p = serialize_bytes (msg_p, (array)->data, (array)->size);
 
 #endif
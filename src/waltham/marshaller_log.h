@@ -28,42 +28,34 @@
 #include <stdlib.h>
 #include <time.h>
 
-/* Comment/uncomment to disable/enable debugging log */
-#define DEBUG
+#include "waltham-private.h"
+
+/* Comment/uncomment to disable/enable profiling */
 //#define PROFILE
 
-#ifdef DEBUG
-static inline void DEBUG_STAMP (void) {
-   char str[200];
-   time_t t;
-   struct tm tm;
+/* Longest message prefix included in a trace */
+#define TRACE_MESSAGE_MAX 64
 
-   t = time (NULL);
-   localtime_r (&t, &tm);
-   strftime (str, sizeof str, "%FT%TZ", &tm);
-   printf ("%s ", str);
-}
+#ifdef WTH_ENABLE_MESSAGE_LOGGING
+static inline void TRACE_MESSAGE (const char *type,
+                                  const unsigned char *data, size_t sz) {
+   char hex[TRACE_MESSAGE_MAX * 2 + 1];
+   size_t itr, n;
 
-static inline void DEBUG_TYPE (const char *type) {
-   printf (" %s\n", type);
-}
+   if (!wth_log_enabled (WTH_LOG_LEVEL_TRACE))
+      return;
 
-static inline void STREAM_DEBUG( unsigned char *data, int sz, char *preamble ){
-   int itr;
-   unsigned char *p = data;
-   for( itr = 0; itr < sz; itr++ ){
-       printf( "%02x", p[itr] );
+   n = sz < TRACE_MESSAGE_MAX ? sz : TRACE_MESSAGE_MAX;
+   for( itr = 0; itr < n; itr++ ){
+       snprintf( hex + itr * 2, 3, "%02x", data[itr] );
    }
-}
+   hex[n * 2] = '\0';
 
-static inline void STREAM_DEBUG_DATA (unsigned char *data, int sz) {
-   printf (" [%i bytes] ", sz);
+   wth_log (WTH_LOG_LEVEL_TRACE, "message -> %s%s [%zu bytes] %s",
+            hex, n < sz ? "..." : "", sz, type);
 }
 #else
-#define STREAM_DEBUG(a, b, c)
-#define STREAM_DEBUG_DATA(a, b)
-#define DEBUG_STAMP()
-#define DEBUG_TYPE(a)
+#define TRACE_MESSAGE(a, b, c)
 #endif
 
 #ifdef PROFILE
@@ -21,51 +21,249 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <string.h>
 #include <sys/uio.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
 
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <netdb.h>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
 #include "message.h"
+#include "compress.h"
 #include "demarshaller.h"
 #include "waltham-private.h"
 
+/* The pages of the ring are mapped a second time right after it, so
+ * that anything starting in the ring can be read contiguously, however
+ * it wraps around. */
+static uint8_t *
+map_mirrored_ring (size_t size)
+{
+  uint8_t *ring;
+  int fd;
+
+  fd = memfd_create ("waltham-reader", MFD_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate (fd, size) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  /* Reserve both halves at once, then map the memory over them */
+  ring = mmap (NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring != MAP_FAILED &&
+      (mmap (ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED ||
+       mmap (ring + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+    {
+      munmap (ring, 2 * size);
+      ring = MAP_FAILED;
+    }
+
+  close (fd);
+
+  return ring != MAP_FAILED ? ring : NULL;
+}
+
+/* Idle readers give their ring back to a pool per size, from 4 KiB
+ * up to READER_RING_MAX_SIZE, for the next reader that needs one. The
+ * pool is shared by the whole process, connections used from different
+ * threads take and return rings under ring_pool_lock. */
+#define RING_POOL_CLASSES 13
+#define RING_POOL_MAX 16
+
+static pthread_mutex_t ring_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  uint8_t *rings[RING_POOL_MAX];
+  int count;
+} ring_pool[RING_POOL_CLASSES];
+
+static int
+ring_pool_class (size_t size)
+{
+  int c = __builtin_ctzl (size) - 12;
+
+  return c < RING_POOL_CLASSES ? c : -1;
+}
+
+static uint8_t *
+ring_acquire (size_t size)
+{
+  int c = ring_pool_class (size);
+  uint8_t *ring = NULL;
+
+  if (c >= 0)
+    {
+      pthread_mutex_lock (&ring_pool_lock);
+      if (ring_pool[c].count > 0)
+        ring = ring_pool[c].rings[--ring_pool[c].count];
+      pthread_mutex_unlock (&ring_pool_lock);
+    }
+
+  return ring ? ring : map_mirrored_ring (size);
+}
+
+static void
+ring_release (uint8_t *ring, size_t size)
+{
+  int c = ring_pool_class (size);
+  bool pooled = false;
+
+  if (c >= 0)
+    {
+      pthread_mutex_lock (&ring_pool_lock);
+      if (ring_pool[c].count < RING_POOL_MAX)
+        {
+          ring_pool[c].rings[ring_pool[c].count++] = ring;
+          pooled = true;
+        }
+      pthread_mutex_unlock (&ring_pool_lock);
+    }
+
+  if (!pooled)
+    munmap (ring, 2 * size);
+}
+
+static size_t
+ring_size_round (size_t size)
+{
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t r = page > READER_RING_MIN_SIZE ? page : READER_RING_MIN_SIZE;
+
+  while (r < size && r < READER_RING_MAX_SIZE)
+    r *= 2;
+
+  return r;
+}
+
 ClientReader *
 new_reader (void)
 {
   ClientReader *r = calloc(1, sizeof(ClientReader));
 
-  r->ringsize = (MESSAGE_MAX_SIZE + sizeof(hdr_t)) * 2 + 1;
-  r->ringbuffer = malloc (r->ringsize);
+  if (r == NULL)
+    return NULL;
+
+  /* The ring is taken when data arrives */
+  r->ring_min = ring_size_round (READER_RING_MIN_SIZE);
+  r->ring_max = ring_size_round (READER_RING_DEFAULT_MAX);
+  r->ringsize = r->ring_min;
+
+  r->messages = calloc(1, READER_MESSAGES_INITIAL * sizeof(ReaderMessage));
+  r->m_total = READER_MESSAGES_INITIAL;
 
-  r->rp = r->wp = r->ringbuffer;
-  r->messages = calloc(1, 64 * sizeof(ReaderMessage));
-  r->m_total = 64;
+  if (r->messages == NULL)
+    {
+      free (r);
+      return NULL;
+    }
 
   return r;
 }
 
+void
+reader_set_ring_limits (ClientReader *reader, size_t min_size,
+  size_t max_size)
+{
+  /* The ring must hold the largest message and one free byte */
+  if (max_size < MESSAGE_MAX_SIZE + sizeof(hdr_t) + 1)
+    max_size = MESSAGE_MAX_SIZE + sizeof(hdr_t) + 1;
+  if (min_size > max_size)
+    min_size = max_size;
+
+  reader->ring_min = ring_size_round (min_size);
+  reader->ring_max = ring_size_round (max_size);
+
+  /* A ring in use is resized when it is given back */
+  if (reader->ringbuffer == NULL)
+    {
+      if ((size_t) reader->ringsize < reader->ring_min)
+        reader->ringsize = reader->ring_min;
+      if ((size_t) reader->ringsize > reader->ring_max)
+        reader->ringsize = reader->ring_max;
+    }
+}
+
+static void
+close_fds (int *fds, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    close (fds[i]);
+}
+
+/* Append n file descriptors to a queue of them */
+static bool
+append_fds (int **fds, int *count, int *total, const int *add, int n)
+{
+  int *f;
+
+  if (*count + n > *total)
+    {
+      int t = *total ? *total * 2 : MAX_FDS_PER_SEND;
+
+      while (t < *count + n)
+        t *= 2;
+
+      f = realloc (*fds, t * sizeof(int));
+      if (f == NULL)
+        return false;
+
+      *fds = f;
+      *total = t;
+    }
+
+  memcpy (*fds + *count, add, n * sizeof(int));
+  *count += n;
+
+  return true;
+}
+
 void
 free_reader (ClientReader *reader)
 {
-  free (reader->ringbuffer);
+  int i;
+
+  reader_flush (reader);
+  if (reader->ringbuffer)
+    ring_release (reader->ringbuffer, reader->ringsize);
+  close_fds (reader->fds, reader->fd_count);
+  free (reader->fds);
+  for (i = 0; i < reader->b_count; i++)
+    free (reader->bulk[i].data);
+  free (reader->bulk);
   free (reader->messages);
   free (reader->tail);
-  free (reader->bounce);
   free (reader);
 }
 
@@ -88,268 +286,1998 @@ bytes_left (ClientReader *reader, uint8_t *rp)
   return left;
 }
 
-static inline uint8_t *
-move_forward (ClientReader *reader, uint8_t *rp, int offset)
-{
-  ssize_t o = ((rp + offset) - reader->ringbuffer) % reader->ringsize;
-  return reader->ringbuffer + o;
-}
+static inline uint8_t *
+move_forward (ClientReader *reader, uint8_t *rp, int offset)
+{
+  uint8_t *p = rp + offset;
+
+  if (p >= reader->ringbuffer + reader->ringsize)
+    p -= reader->ringsize;
+
+  return p;
+}
+
+/* Unaligned reads, data past the end of the ring is read from its
+ * mirror */
+static inline uint16_t
+get_uint16 (const uint8_t *rp, int offset)
+{
+  uint16_t r;
+
+  memcpy (&r, rp + offset, sizeof r);
+
+  return r;
+}
+
+static inline uint32_t
+get_uint32 (const uint8_t *rp, int offset)
+{
+  uint32_t r;
+
+  memcpy (&r, rp + offset, sizeof r);
+
+  return r;
+}
+
+/* Add a complete message from its compressed body, in a buffer of its
+ * own like reassembled messages */
+static bool
+reader_add_decompressed (ClientReader *reader, uint16_t opcode,
+  const uint8_t *body, size_t size)
+{
+  ReaderMessage *rm;
+  uint32_t length;
+  uint8_t *buf;
+  hdr_t hdr = { 0, 0, opcode, 0 };
+
+  if (size < sizeof length)
+    goto bad_message;
+
+  memcpy (&length, body, sizeof length);
+  if (length > MESSAGE_MAX_REASSEMBLED_SIZE)
+    goto bad_message;
+
+  buf = malloc (sizeof hdr + length);
+  if (buf == NULL)
+    {
+      errno = ENOMEM;
+      return false;
+    }
+
+  if (decompress_block (body + sizeof length, size - sizeof length,
+                        buf + sizeof hdr, length) != length)
+    {
+      free (buf);
+      goto bad_message;
+    }
+
+  if (sizeof hdr + length <= 0xffff)
+    hdr.sz = sizeof hdr + length;
+  memcpy (buf, &hdr, sizeof hdr);
+
+  rm = &reader->messages[reader->m_complete++];
+  rm->start = buf;
+  rm->length = sizeof hdr + length;
+  rm->reassembled = buf;
+  memcpy (&rm->flags, buf, READER_MESSAGE_FIELDS * sizeof (uint16_t));
+
+  return true;
+
+bad_message:
+  wth_error ("Invalid compressed message (opcode %d)", opcode);
+  errno = EBADMSG;
+  return false;
+}
+
+/* Bytes an entry counts against the limit, so that empty data
+ * arguments are not free either */
+static size_t
+bulk_data_cost (size_t size)
+{
+  return sizeof(struct bulk_data) + size;
+}
+
+bool
+reader_add_bulk_data (ClientReader *reader, uint32_t id,
+  const void *data, size_t size)
+{
+  struct bulk_data *b;
+
+  /* The client numbers them in the order it sends them */
+  if (reader->b_count > 0 && id <= reader->bulk[reader->b_count - 1].id)
+    {
+      errno = EINVAL;
+      return false;
+    }
+
+  if (size > MESSAGE_MAX_REASSEMBLED_SIZE ||
+      reader->b_bytes + bulk_data_cost (size) > MESSAGE_MAX_REASSEMBLED_SIZE)
+    {
+      errno = ENOBUFS;
+      return false;
+    }
+
+  if (reader->b_count == reader->b_total && reader->b_first > 0)
+    {
+      memmove (reader->bulk, reader->bulk + reader->b_first,
+        (reader->b_count - reader->b_first) * sizeof(struct bulk_data));
+      reader->b_count -= reader->b_first;
+      reader->b_first = 0;
+    }
+
+  if (reader->b_count == reader->b_total)
+    {
+      int total = reader->b_total ? reader->b_total * 2 : 8;
+
+      b = realloc (reader->bulk, total * sizeof(struct bulk_data));
+      if (b == NULL)
+        {
+          errno = ENOMEM;
+          return false;
+        }
+
+      reader->bulk = b;
+      reader->b_total = total;
+    }
+
+  b = &reader->bulk[reader->b_count];
+  b->data = malloc (size ? size : 1);
+  if (b->data == NULL)
+    {
+      errno = ENOMEM;
+      return false;
+    }
+
+  memcpy (b->data, data, size);
+  b->id = id;
+  b->size = size;
+  reader->b_count++;
+  reader->b_bytes += bulk_data_cost (size);
+
+  return true;
+}
+
+/* Binary search, the ids are increasing */
+static int
+reader_find_bulk_data (ClientReader *reader, uint32_t id)
+{
+  int lo = reader->b_first;
+  int hi = reader->b_count;
+
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+
+      if (reader->bulk[mid].id < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  if (lo < reader->b_count && reader->bulk[lo].id == id &&
+      reader->bulk[lo].data != NULL)
+    return lo;
+
+  return -1;
+}
+
+/* Free the data of a referenced entry. Its id stays for the search
+ * until the entries before it are gone as well. */
+static void
+reader_consume_bulk_data (ClientReader *reader, int b)
+{
+  free (reader->bulk[b].data);
+  reader->bulk[b].data = NULL;
+  reader->b_bytes -= bulk_data_cost (reader->bulk[b].size);
+
+  while (reader->b_first < reader->b_count &&
+         reader->bulk[reader->b_first].data == NULL)
+    reader->b_first++;
+
+  if (reader->b_first == reader->b_count)
+    reader->b_first = reader->b_count = 0;
+}
+
+/* Data arguments are followed by padding to 4 bytes, which the message
+ * leaves out along with them */
+static size_t
+bulk_padded (size_t size)
+{
+  return (size + 3) & ~(size_t) 3;
+}
+
+/* Add a complete message from one whose data arguments were sent on the
+ * side channel, in a buffer of its own like reassembled messages.
+ * Returns 0 while some of its data has not arrived yet. */
+static int
+reader_add_bulk_message (ClientReader *reader, size_t size)
+{
+  size_t body_size = size - sizeof(hdr_t);
+  ReaderMessage *rm;
+  uint32_t count;
+  uint32_t desc[3];
+  const uint8_t *msg = reader->rp;
+  uint8_t *buf = NULL;
+  const uint8_t *src;
+  uint8_t *out;
+  size_t src_left;
+  size_t length;
+  size_t pos = 0;
+  hdr_t hdr;
+  uint32_t i;
+  int b;
+
+  if (body_size < sizeof count)
+    goto bad_message;
+
+  count = get_uint32 (reader->rp, sizeof(hdr_t));
+  if (count > (body_size - sizeof count) / sizeof desc)
+    goto bad_message;
+
+  /* Stall the stream rather than dispatch out of order */
+  length = body_size - sizeof count - count * sizeof desc;
+  for (i = 0; i < count; i++)
+    {
+      uint32_t id = get_uint32 (reader->rp,
+        sizeof(hdr_t) + sizeof count + i * sizeof desc);
+
+      b = reader_find_bulk_data (reader, id);
+      if (b < 0)
+        return 0;
+
+      length += bulk_padded (reader->bulk[b].size);
+    }
+
+  if (length > MESSAGE_MAX_REASSEMBLED_SIZE)
+    goto bad_message;
+
+  buf = malloc (sizeof hdr + length);
+  if (buf == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  memcpy (&hdr, msg, sizeof hdr);
+  src = msg + sizeof hdr + sizeof count + count * sizeof desc;
+  src_left = msg + size - src;
+  out = buf + sizeof hdr;
+
+  for (i = 0; i < count; i++)
+    {
+      memcpy (desc, msg + sizeof hdr + sizeof count + i * sizeof desc,
+        sizeof desc);
+      b = reader_find_bulk_data (reader, desc[0]);
+
+      /* Offsets must be in order, within the body, and sizes match */
+      if (b < 0 || desc[1] < pos || desc[1] - pos > src_left ||
+          desc[2] != reader->bulk[b].size)
+        goto bad_message;
+
+      memcpy (out, src, desc[1] - pos);
+      out += desc[1] - pos;
+      src += desc[1] - pos;
+      src_left -= desc[1] - pos;
+
+      memcpy (out, reader->bulk[b].data, desc[2]);
+      memset (out + desc[2], 0, bulk_padded (desc[2]) - desc[2]);
+      out += bulk_padded (desc[2]);
+      pos = desc[1] + bulk_padded (desc[2]);
+
+      reader_consume_bulk_data (reader, b);
+    }
+  memcpy (out, src, src_left);
+
+  hdr.flags &= ~M_FLAG_BULK;
+  hdr.sz = sizeof hdr + length <= 0xffff ? sizeof hdr + length : 0;
+  memcpy (buf, &hdr, sizeof hdr);
+
+  rm = &reader->messages[reader->m_complete++];
+  rm->start = buf;
+  rm->length = sizeof hdr + length;
+  rm->reassembled = buf;
+  memcpy (&rm->flags, buf, READER_MESSAGE_FIELDS * sizeof (uint16_t));
+
+  return 1;
+
+bad_message:
+  free (buf);
+  wth_error ("Invalid message with side channel data (opcode %d)",
+    get_uint16 (reader->rp, M_OFFSET_OPCODE));
+  errno = EBADMSG;
+  return -1;
+}
+
+/* Append one frame of a fragmented message to the reader's tail. Once the
+ * last frame is in, the tail becomes a complete message of its own. */
+static bool
+reader_add_fragment (ClientReader *reader, uint16_t flags, size_t size)
+{
+  uint16_t opcode = get_uint16 (reader->rp, M_OFFSET_OPCODE);
+  size_t offset = sizeof(hdr_t);
+  ReaderMessage *rm;
+
+  if (flags & M_FLAG_FRAGMENT_FIRST)
+    {
+      uint32_t length;
+      hdr_t hdr = { flags & M_FLAG_COMPRESSED, 0, opcode, 0 };
+
+      if (reader->taillength != 0 || size < sizeof(hdr_t) + sizeof length)
+        goto bad_fragment;
+
+      length = get_uint32 (reader->rp, offset);
+      offset += sizeof length;
+      if (length > MESSAGE_MAX_REASSEMBLED_SIZE)
+        goto bad_fragment;
+
+      if (reader->allocated_tailsize < (ssize_t)(sizeof hdr + length))
+        {
+          free (reader->tail);
+          reader->allocated_tailsize = sizeof hdr + length;
+          reader->tail = malloc (reader->allocated_tailsize);
+          if (reader->tail == NULL)
+            {
+              reader->allocated_tailsize = 0;
+              errno = ENOMEM;
+              return false;
+            }
+        }
+
+      memcpy (reader->tail, &hdr, sizeof hdr);
+      reader->tailsize = sizeof hdr;
+      reader->taillength = sizeof hdr + length;
+    }
+  else if (reader->taillength == 0 ||
+           opcode != ((hdr_t *) reader->tail)->opcode)
+    {
+      goto bad_fragment;
+    }
+
+  if ((ssize_t)(size - offset) > reader->taillength - reader->tailsize)
+    goto bad_fragment;
+
+  memcpy (reader->tail + reader->tailsize,
+    move_forward (reader, reader->rp, offset), size - offset);
+  reader->tailsize += size - offset;
+
+  if (reader->tailsize < reader->taillength)
+    return true;
+
+  if (((hdr_t *) reader->tail)->flags & M_FLAG_COMPRESSED)
+    {
+      bool ret = reader_add_decompressed (reader, opcode,
+        reader->tail + sizeof(hdr_t), reader->taillength - sizeof(hdr_t));
+
+      free (reader->tail);
+      reader->tail = NULL;
+      reader->tailsize = 0;
+      reader->allocated_tailsize = 0;
+      reader->taillength = 0;
+
+      return ret;
+    }
+
+  /* The message now lives in its own buffer, freed by reader_flush() */
+  rm = &reader->messages[reader->m_complete++];
+  rm->start = reader->tail;
+  rm->length = reader->taillength;
+  rm->reassembled = reader->tail;
+  memcpy (&rm->flags, reader->tail, READER_MESSAGE_FIELDS * sizeof (uint16_t));
+
+  reader->tail = NULL;
+  reader->tailsize = 0;
+  reader->allocated_tailsize = 0;
+  reader->taillength = 0;
+
+  return true;
+
+bad_fragment:
+  wth_error ("Invalid message fragment (opcode %d)", opcode);
+  errno = EBADMSG;
+  return false;
+}
+
+/* Returns 1 when a message or fragment was taken from the ring, 0 when
+ * more data is needed and -1 on a malformed stream */
+static int
+get_one_message (ClientReader *reader)
+{
+  size_t size;
+  uint16_t flags;
+  size_t left = bytes_left (reader, reader->rp);
+
+  if (left < sizeof(hdr_t))
+    return 0;
+
+  size = get_uint16 (reader->rp, M_OFFSET_SIZE);
+
+  if (left < size)
+    return 0;
+
+  if (size < sizeof(hdr_t))
+    {
+      wth_error ("Invalid message size (%zu)", size);
+      errno = EBADMSG;
+      return -1;
+    }
+
+  flags = get_uint16 (reader->rp, M_OFFSET_FLAGS);
+  if (flags & (M_FLAG_FRAGMENT_FIRST | M_FLAG_FRAGMENT))
+    {
+      if (!reader_add_fragment (reader, flags, size))
+        return -1;
+
+      reader->rp = move_forward (reader, reader->rp, size);
+      return 1;
+    }
+
+  if (flags & M_FLAG_BULK)
+    {
+      int ret = reader_add_bulk_message (reader, size);
+
+      if (ret <= 0)
+        return ret;
+
+      reader->rp = move_forward (reader, reader->rp, size);
+      return 1;
+    }
+
+  if (flags & M_FLAG_COMPRESSED)
+    {
+      uint16_t opcode = get_uint16 (reader->rp, M_OFFSET_OPCODE);
+
+      if (!reader_add_decompressed (reader, opcode,
+            move_forward (reader, reader->rp, sizeof(hdr_t)),
+            size - sizeof(hdr_t)))
+        return -1;
+
+      reader->rp = move_forward (reader, reader->rp, size);
+      return 1;
+    }
+
+  reader->messages[reader->m_complete].start = reader->rp;
+  reader->messages[reader->m_complete].length = size;
+  reader->messages[reader->m_complete].reassembled = NULL;
+
+  memcpy (&reader->messages[reader->m_complete].flags,
+    reader->rp, READER_MESSAGE_FIELDS * sizeof (uint16_t));
+
+  reader->m_complete++;
+
+  reader->rp = move_forward (reader, reader->rp, size);
+
+  return 1;
+}
+
+/* Queue the received file descriptors. Once one is lost, every later
+ * fd argument would go with the wrong message: the ones that did arrive
+ * are closed, and this fails with EPROTO, or ENOMEM. */
+static bool
+reader_receive_fds (ClientReader *reader, struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  int err = 0;
+  int n;
+
+  if (msg->msg_flags & MSG_CTRUNC)
+    {
+      wth_error ("File descriptors were lost, the peer sent too many");
+      err = EPROTO;
+    }
+
+  for (cmsg = CMSG_FIRSTHDR (msg); cmsg; cmsg = CMSG_NXTHDR (msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof(int);
+      if (err == 0 &&
+          !append_fds (&reader->fds, &reader->fd_count, &reader->fd_total,
+                       (int *) CMSG_DATA (cmsg), n))
+        {
+          wth_error ("Out of memory, closing received file descriptors");
+          err = ENOMEM;
+        }
+
+      if (err)
+        close_fds ((int *) CMSG_DATA (cmsg), n);
+    }
+
+  errno = err;
+  return err == 0;
+}
+
+int
+reader_take_fd (ClientReader *reader)
+{
+  int fd;
+
+  if (reader->fd_count == 0)
+    return -1;
+
+  fd = reader->fds[0];
+  reader->fd_count--;
+  memmove (reader->fds, reader->fds + 1, reader->fd_count * sizeof(int));
+
+  return fd;
+}
+
+/* Start of the ring data still in use: messages not dispatched yet, and
+ * what has not been parsed */
+static uint8_t *
+reader_ring_start (ClientReader *reader)
+{
+  int i;
+
+  for (i = 0; i < reader->m_complete; i++)
+    if (!reader->messages[i].reassembled)
+      return reader->messages[i].start;
+
+  return reader->rp;
+}
+
+/* Free space in the ring, which continues into the mirror. The write
+ * pointer never completely catches up with the read pointer. */
+static size_t
+reader_ring_space (ClientReader *reader)
+{
+  return reader->ringsize - 1 - bytes_left (reader, reader_ring_start (reader));
+}
+
+/* Whether a complete message waits at the read pointer that dispatching
+ * would take out of the ring */
+static bool
+reader_has_message (ClientReader *reader)
+{
+  size_t left = bytes_left (reader, reader->rp);
+  const hdr_t *hdr = (const hdr_t *) reader->rp;
+
+  return left >= sizeof(hdr_t) && left >= hdr->sz &&
+    !(hdr->flags & M_FLAG_BULK);
+}
+
+/* Bytes from the ring position from to p */
+static size_t
+ring_offset (ClientReader *reader, uint8_t *from, uint8_t *p)
+{
+  return p >= from ? p - from : p + reader->ringsize - from;
+}
+
+/* Move the data in use to a ring of another size */
+static bool
+reader_resize_ring (ClientReader *reader, size_t size)
+{
+  uint8_t *start = reader_ring_start (reader);
+  size_t used = bytes_left (reader, start);
+  uint8_t *ring;
+  int i;
+
+  ring = ring_acquire (size);
+  if (ring == NULL)
+    return false;
+
+  memcpy (ring, start, used);
+  for (i = 0; i < reader->m_complete; i++)
+    if (!reader->messages[i].reassembled)
+      reader->messages[i].start =
+        ring + ring_offset (reader, start, reader->messages[i].start);
+  reader->rp = ring + ring_offset (reader, start, reader->rp);
+  reader->wp = ring + used;
+
+  ring_release (reader->ringbuffer, reader->ringsize);
+  reader->ringbuffer = ring;
+  reader->ringsize = size;
+
+  wth_debug ("Receive buffer now %zu bytes", size);
+
+  return true;
+}
+
+static bool
+reader_take_ring (ClientReader *reader)
+{
+  reader->ringbuffer = ring_acquire (reader->ringsize);
+  if (reader->ringbuffer == NULL)
+    {
+      wth_error ("Cannot allocate the receive buffer: %m");
+      return false;
+    }
+
+  reader->rp = reader->wp = reader->ringbuffer;
+  reader->ring_peak = 0;
+
+  return true;
+}
+
+/* Give the empty ring back while idle. Rings that stay mostly unused
+ * shrink, and so do message slots grown for a burst. */
+static void
+reader_give_back_ring (ClientReader *reader)
+{
+  ReaderMessage *m;
+
+  ring_release (reader->ringbuffer, reader->ringsize);
+  reader->ringbuffer = reader->rp = reader->wp = NULL;
+
+  if (reader->ring_peak > (size_t) reader->ringsize / 4 ||
+      (size_t) reader->ringsize <= reader->ring_min)
+    reader->quiet_periods = 0;
+  else if (++reader->quiet_periods >= READER_SHRINK_PERIODS)
+    {
+      reader->ringsize /= 2;
+      reader->quiet_periods = 0;
+    }
+
+  if ((size_t) reader->ringsize > reader->ring_max)
+    reader->ringsize = reader->ring_max;
+  if ((size_t) reader->ringsize < reader->ring_min)
+    reader->ringsize = reader->ring_min;
+
+  if (reader->m_total > READER_MESSAGES_INITIAL * 8)
+    {
+      m = realloc (reader->messages,
+        READER_MESSAGES_INITIAL * sizeof(ReaderMessage));
+      if (m)
+        {
+          reader->messages = m;
+          reader->m_total = READER_MESSAGES_INITIAL;
+        }
+    }
+}
+
+/* Read at most size bytes to the write pointer. Returns the number of
+ * bytes read, or -1 with errno set, ECONNRESET at the end of the
+ * stream. */
+static ssize_t
+reader_fill_ring_buffer (ClientReader *reader, int fd, size_t size)
+{
+  struct iovec vec;
+  ssize_t ret;
+  struct msghdr msg;
+  char control[CMSG_SPACE (MAX_FDS_PER_SEND * sizeof(int))];
+
+  vec.iov_base = reader->wp;
+  vec.iov_len = size;
+
+  /* File descriptors come along with the data on AF_UNIX sockets */
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &vec;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  do {
+    ret = recvmsg (fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  } while (ret == -1 && errno == EINTR);
+
+  if (ret == 0) {
+    wth_debug ("Connection closed by the peer");
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  if (ret < 0) {
+    if (errno != EAGAIN)
+      wth_error ("Error while filling buffer: %m");
+    return -1;
+  }
+
+  reader->total_read += ret;
+  reader->wp = move_forward (reader, reader->wp, ret);
+
+  assert (reader->wp != reader->rp);
+
+  if (msg.msg_controllen > 0 && !reader_receive_fds (reader, &msg))
+    return -1;
+
+  return ret;
+}
+
+
+int
+reader_pull_new_messages (ClientReader *reader, int fd, size_t max_bytes,
+  int max_messages)
+{
+  size_t total = 0;
+  size_t room;
+  size_t size;
+  ssize_t used;
+  ssize_t ret;
+  int fd_count;
+
+  if (reader->ringbuffer == NULL && !reader_take_ring (reader))
+    return -1;
+
+  /* Messages are only parsed ahead to count them; dispatching takes
+   * them straight from the ring otherwise */
+  if (max_messages || reader->parsed_ahead)
+    {
+      if (!reader_parse_messages (reader, max_messages))
+        return -1;
+      if (max_messages && reader->m_complete >= max_messages)
+        return 1;
+    }
+
+  for (;;)
+    {
+      /* Room is made by dispatching, or else by a larger ring. A
+       * message held up by missing side channel data only moves on
+       * when that arrives. */
+      size = reader_ring_space (reader);
+      if (size == 0 &&
+          (reader->m_complete > 0 || reader_has_message (reader)))
+        return 1;
+      if (size == 0 &&
+          ((size_t) reader->ringsize >= reader->ring_max ||
+           !reader_resize_ring (reader, reader->ringsize * 2)))
+        return 0;
+      room = reader_ring_space (reader);
+
+      size = room;
+      if (max_bytes && size > max_bytes - total)
+        size = max_bytes - total;
+
+      fd_count = reader->fd_count;
+      ret = reader_fill_ring_buffer (reader, fd, size);
+      if (ret < 0)
+        return errno == EAGAIN ? 0 : -1;
+
+      used = bytes_left (reader, reader_ring_start (reader));
+      if ((size_t) used > reader->ring_peak)
+        reader->ring_peak = used;
+
+      if ((max_messages || reader->parsed_ahead) &&
+          !reader_parse_messages (reader, max_messages))
+        return -1;
+
+      /* The socket had at least as much as there was room for. A
+       * larger ring takes more per read. */
+      if ((size_t) ret == room &&
+          (size_t) reader->ringsize < reader->ring_max)
+        reader_resize_ring (reader, reader->ringsize * 2);
+
+      total += ret;
+      if ((max_bytes && total >= max_bytes) ||
+          (max_messages && reader->m_complete >= max_messages))
+        return 1;
+
+      /* A stream socket returns less than asked for only when it has
+       * nothing more, saving the read that would fail with EAGAIN.
+       * Data that came with file descriptors ends early though. */
+      if ((size_t) ret < size && reader->fd_count == fd_count)
+        return 0;
+    }
+}
+
+/* Keep a free slot after the parsed messages */
+static void
+reader_grow_messages (ClientReader *reader)
+{
+  if (reader->m_complete < reader->m_total)
+    return;
+
+  reader->messages = realloc (reader->messages,
+    reader->m_total * 2 * sizeof(ReaderMessage));
+  reader->m_total *= 2;
+  wth_debug ("Updated client to %d messages", reader->m_total);
+}
+
+bool
+reader_parse_messages (ClientReader *reader, int max_messages)
+{
+  int ret = 0;
+
+  reader->parsed_ahead = true;
+
+  /* Setup message headers */
+  while ((!max_messages || reader->m_complete < max_messages) &&
+         (ret = get_one_message (reader)) > 0)
+    reader_grow_messages (reader);
+
+  return ret >= 0;
+}
+
+/* File one message buffer */
+void
+reader_map_message (ClientReader *reader, int m, msg_t *msg)
+{
+  ReaderMessage *rm;
+  void *start;
+
+  assert (m >= 0 && m < reader->m_complete);
+  memset (msg, 0, sizeof (msg_t));
+
+  rm = &reader->messages[m];
+
+  start = rm->start;
+  msg->length = rm->length;
+  if (rm->reassembled)
+    {
+      msg->hdr = start;
+      msg->body = start + sizeof(hdr_t);
+      return;
+    }
+
+  /* Messages wrapping around the end of the ring continue in its
+   * mirror, so the whole message is linearly in memory from start */
+  msg->hdr = start;
+  msg->body = start + sizeof(hdr_t);
+  if (rm->length > msg->hdr->sz)
+    {
+      msg->chunks[0].data = start + msg->hdr->sz;
+      msg->chunks[0].size = rm->length - msg->hdr->sz;
+    }
+}
+
+int
+reader_next_message (ClientReader *reader, msg_t *msg)
+{
+  const hdr_t *hdr;
+  size_t left;
+  int ret;
+
+  for (;;)
+    {
+      if (reader->m_next < reader->m_complete)
+        {
+          reader_map_message (reader, reader->m_next++, msg);
+          return 1;
+        }
+
+      if (reader->parsed_ahead)
+        return 0;
+
+      /* Plain messages are handed out where they are in the ring. They
+       * start 4-byte aligned, as every message is padded to that. */
+      left = bytes_left (reader, reader->rp);
+      if (left < sizeof(hdr_t))
+        return 0;
+
+      hdr = (const hdr_t *) reader->rp;
+      if (hdr->flags == 0 && hdr->sz >= sizeof(hdr_t))
+        {
+          if (left < hdr->sz)
+            return 0;
+
+          msg->hdr = (hdr_t *) hdr;
+          msg->body = (char *) reader->rp + sizeof(hdr_t);
+          msg->length = hdr->sz;
+          msg->chunks[0].size = 0;
+          msg->chunks[1].size = 0;
+          reader->rp = move_forward (reader, reader->rp, hdr->sz);
+          return 1;
+        }
+
+      /* Anything else goes through the table, or is held up */
+      ret = get_one_message (reader);
+      if (ret <= 0)
+        return ret;
+      reader_grow_messages (reader);
+    }
+}
+
+bool
+reader_forward_message_range (ClientReader *reader, int fd, int s, int e)
+{
+  ssize_t ret;
+  uint8_t *start;
+  uint8_t *end;
+  size_t length;
+  int i;
+
+  assert (s <= e && e < reader->m_complete);
+
+  /* The ring only holds the frames of fragmented messages */
+  for (i = s; i <= e; i++)
+    if (reader->messages[i].reassembled)
+      {
+        errno = EMSGSIZE;
+        return false;
+      }
+
+  start = reader->messages[s].start;
+  end = move_forward (reader, reader->messages[e].start,
+    reader->messages[e].length);
+
+  assert (reader->m_complete > 0);
+
+  /* A range that wraps around continues in the mirror */
+  length = end > start ? end - start : end + reader->ringsize - start;
+
+  ret = write (fd, start, length);
+
+  return ret == (ssize_t) length;
+}
+
+/* Forget the first count parsed messages. The ones after them are kept
+ * for later. */
+static void
+reader_drop_messages (ClientReader *reader, int count)
+{
+  int i;
+
+  assert (count >= 0 && count <= reader->m_complete);
+
+  for (i = 0; i < count; i++)
+    free (reader->messages[i].reassembled);
+  reader->m_complete -= count;
+  reader->m_next = reader->m_next > count ? reader->m_next - count : 0;
+  if (reader->m_complete == 0)
+    reader->parsed_ahead = false;
+
+  /* The rest stay in the ring where they are, only the slots move */
+  if (reader->m_complete > 0)
+    {
+      memmove (reader->messages, reader->messages + count,
+        reader->m_complete * sizeof(ReaderMessage));
+      return;
+    }
+
+  /* In most cases the message handling will have handled the full
+   * ringbuffer (e.g. the recvmsg call read in upto the message
+   * boundaries). An idle connection needs no ring until more arrives. */
+  if (reader->ringbuffer && reader->wp == reader->rp)
+    reader_give_back_ring (reader);
+}
+
+void
+reader_release_messages (ClientReader *reader)
+{
+  reader_drop_messages (reader, reader->m_next);
+}
+
+void
+reader_flush (ClientReader *reader)
+{
+  reader_drop_messages (reader, reader->m_complete);
+}
+
+bool
+reader_forward_all_messages (ClientReader *reader, int fd)
+{
+  bool ret;
+
+  if (!reader_parse_messages (reader, 0))
+    return false;
+  if (reader->m_complete == 0)
+    return true;
+
+  ret = reader_forward_message_range (reader, fd, 0, reader->m_complete - 1);
+
+  reader_flush (reader);
+
+  return ret;
+}
+
+/**** Ringbuffer based network writer
+ *
+ * Outgoing messages are never split over the end of the ring: when a
+ * message does not fit between the write pointer and the end, the data end
+ * is remembered in wrap and writing continues from the ring start. That
+ * keeps every message contiguous for the marshallers, while sending needs
+ * at most two iovecs.
+ */
+
+#define WRITER_INITIAL_SIZE 4096
+
+static void
+reference_release (ClientWriter *writer, WriterReference *ref)
+{
+  if (ref->notify && writer->release)
+    writer->release (ref->notify, writer->release_data);
+
+  free (ref->owned);
+}
+
+ClientWriter *
+new_writer (void)
+{
+  ClientWriter *w = calloc(1, sizeof(ClientWriter));
+
+  if (w == NULL)
+    return NULL;
+
+  w->ringsize = WRITER_INITIAL_SIZE;
+  w->ringbuffer = malloc (w->ringsize);
+  if (w->ringbuffer == NULL)
+    {
+      free (w);
+      return NULL;
+    }
+
+  w->rp = w->wp = w->ringbuffer;
+
+  return w;
+}
+
+size_t
+writer_queued (ClientWriter *writer)
+{
+  return writer->queued + writer->ref_queued;
+}
+
+void
+free_writer (ClientWriter *writer)
+{
+  int i;
+
+  /* Nothing will be sent anymore, the caller may reuse all memory. The
+   * socket must have been reset if the kernel still held some of it,
+   * see writer_zerocopy_pending(). */
+  for (i = 0; i < writer->r_count; i++)
+    reference_release (writer, &writer->refs[i]);
+
+  close_fds (writer->fds, writer->fd_count);
+  free (writer->fds);
+  free (writer->refs);
+  free (writer->boundaries);
+  free (writer->msgs);
+  free (writer->ringbuffer);
+  free (writer);
+}
+
+static uint8_t *
+writer_contiguous_space (ClientWriter *writer, size_t size)
+{
+  if (writer->queued == 0)
+    {
+      /* Restart from the ring start whenever everything has been sent */
+      writer->rp = writer->wp = writer->ringbuffer;
+      writer->wrap = NULL;
+    }
+
+  if (writer->wrap)
+    {
+      if ((size_t)(writer->rp - writer->wp) >= size)
+        return writer->wp;
+
+      return NULL;
+    }
+
+  if ((size_t)(writer->ringbuffer + writer->ringsize - writer->wp) >= size)
+    return writer->wp;
+
+  if ((size_t)(writer->rp - writer->ringbuffer) >= size)
+    return writer->ringbuffer;
+
+  return NULL;
+}
+
+static bool
+writer_grow (ClientWriter *writer, size_t size)
+{
+  ssize_t ringsize = writer->ringsize;
+  uint8_t *ring;
+  size_t l;
+
+  while ((size_t) ringsize < writer->queued + size)
+    ringsize *= 2;
+
+  ring = malloc (ringsize);
+  if (ring == NULL)
+    return false;
+
+  /* Linearize the queued data at the start of the new ring */
+  if (writer->wrap)
+    {
+      l = writer->wrap - writer->rp;
+      memcpy (ring, writer->rp, l);
+      memcpy (ring + l, writer->ringbuffer, writer->wp - writer->ringbuffer);
+    }
+  else
+    {
+      memcpy (ring, writer->rp, writer->queued);
+    }
+
+  free (writer->ringbuffer);
+  writer->ringbuffer = ring;
+  writer->ringsize = ringsize;
+  writer->rp = ring;
+  writer->wp = ring + writer->queued;
+  writer->wrap = NULL;
+
+  wth_debug ("Grew send buffer to %zd bytes", ringsize);
+
+  return true;
+}
+
+bool
+writer_has_space (ClientWriter *writer, size_t size)
+{
+  return writer_contiguous_space (writer, size) != NULL;
+}
+
+uint8_t *
+writer_reserve (ClientWriter *writer, size_t size)
+{
+  uint8_t *p;
+
+  p = writer_contiguous_space (writer, size);
+  if (p == NULL)
+    {
+      if (!writer_grow (writer, size))
+        return NULL;
+
+      p = writer->wp;
+    }
+
+  if (p != writer->wp)
+    {
+      /* Not enough room before the end of the ring, continue at start */
+      writer->wrap = writer->wp;
+      writer->wp = p;
+    }
+
+  writer->r_reserved = writer->r_count;
+
+  return p;
+}
+
+static bool
+writer_add_boundary (ClientWriter *writer, uint64_t position)
+{
+  uint64_t *b;
+
+  if (writer->b_count == writer->b_total)
+    {
+      int total = writer->b_total ? writer->b_total * 2 : 16;
+
+      b = realloc (writer->boundaries, total * sizeof(uint64_t));
+      if (b == NULL)
+        return false;
+
+      writer->boundaries = b;
+      writer->b_total = total;
+    }
+
+  writer->boundaries[writer->b_count++] = position;
+
+  return true;
+}
+
+static void
+writer_track_message (ClientWriter *writer, size_t size, bool coalescible,
+  uint32_t key)
+{
+  WriterMessage *m;
+  int n = 0;
+
+  /* Forget messages that are on their way */
+  while (n < writer->m_count && writer->msgs[n].ring_offset < writer->ring_sent)
+    n++;
+
+  if (n > 0)
+    {
+      memmove (writer->msgs, writer->msgs + n,
+        (writer->m_count - n) * sizeof(WriterMessage));
+      writer->m_count -= n;
+    }
+
+  if (writer->m_count == writer->m_total)
+    {
+      int total = writer->m_total ? writer->m_total * 2 : 16;
+
+      m = realloc (writer->msgs, total * sizeof(WriterMessage));
+      if (m == NULL)
+        {
+          /* Without a record, nothing will be coalesced with it. Older
+           * messages must not be coalesced past it either. */
+          writer->m_count = 0;
+          return;
+        }
+
+      writer->msgs = m;
+      writer->m_total = total;
+    }
+
+  m = &writer->msgs[writer->m_count++];
+  m->ring_offset = writer->ring_committed;
+  memcpy (&m->opcode, writer->wp + M_OFFSET_OPCODE, sizeof m->opcode);
+  memcpy (&m->object, writer->wp + sizeof(hdr_t), sizeof m->object);
+  m->key = key;
+  m->size = size;
+  m->coalescible = coalescible;
+}
+
+/* Location in the ring of a queued byte at stream position ring_offset */
+static uint8_t *
+writer_ring_at (ClientWriter *writer, uint64_t ring_offset)
+{
+  size_t offset = ring_offset - writer->ring_sent;
+
+  if (writer->wrap && writer->rp + offset >= writer->wrap)
+    return writer->ringbuffer + (offset - (writer->wrap - writer->rp));
+
+  return writer->rp + offset;
+}
+
+static void
+writer_advance (ClientWriter *writer, size_t size)
+{
+  uint64_t last;
+  int i;
+
+  writer->wp += size;
+  writer->queued += size;
+  writer->ring_committed += size;
+
+  writer->committed += size;
+  for (i = writer->r_reserved; i < writer->r_count; i++)
+    writer->committed += writer->refs[i].size;
+
+  /* Let others send in between at least every BULK_SLICE_SIZE bytes */
+  last = writer->b_count ? writer->boundaries[writer->b_count - 1] :
+    writer->unit_end;
+  if (writer->committed - last >= BULK_SLICE_SIZE)
+    writer_add_boundary (writer, writer->committed);
+}
+
+void
+writer_commit (ClientWriter *writer, size_t size)
+{
+  if (writer->coalesce)
+    writer_track_message (writer, size, false, 0);
+
+  writer_advance (writer, size);
+}
+
+void
+writer_commit_coalescible (ClientWriter *writer, size_t size, uint32_t key)
+{
+  WriterMessage *m;
+  uint32_t object;
+  uint16_t opcode;
+  bool delimiter;
+  int i;
+
+  if (!writer->coalesce || writer->r_count > writer->r_reserved)
+    {
+      writer_commit (writer, size);
+      return;
+    }
+
+  memcpy (&opcode, writer->wp + M_OFFSET_OPCODE, sizeof opcode);
+  memcpy (&object, writer->wp + sizeof(hdr_t), sizeof object);
+
+  /* Messages without arguments, like frame events, only delimit others.
+   * They merge with an identical predecessor only, while messages with
+   * arguments may move ahead of other coalescible ones. */
+  delimiter = size == sizeof(hdr_t) + sizeof object;
+
+  for (i = writer->m_count - 1; i >= 0; i--)
+    {
+      m = &writer->msgs[i];
+
+      /* Partially sent messages cannot change anymore */
+      if (m->ring_offset < writer->ring_sent)
+        break;
+
+      if (m->object != object)
+        continue;
+
+      if (!m->coalescible)
+        break;
+
+      if (m->opcode != opcode || m->key != key)
+        {
+          if (delimiter)
+            break;
+          continue;
+        }
+
+      if (m->size != size)
+        break;
+
+      memcpy (writer_ring_at (writer, m->ring_offset), writer->wp, size);
+      return;
+    }
+
+  writer_track_message (writer, size, true, key);
+  writer_advance (writer, size);
+}
+
+void
+writer_set_coalesce (ClientWriter *writer, bool coalesce)
+{
+  writer->coalesce = coalesce;
+  writer->m_count = 0;
+}
+
+static WriterReference *
+writer_new_reference (ClientWriter *writer, size_t offset,
+  const void *data, size_t size)
+{
+  WriterReference *ref;
+
+  if (writer->r_count == writer->r_total)
+    {
+      int total = writer->r_total ? writer->r_total * 2 : 8;
+
+      ref = realloc (writer->refs, total * sizeof(WriterReference));
+      if (ref == NULL)
+        return NULL;
+
+      writer->refs = ref;
+      writer->r_total = total;
+    }
+
+  ref = &writer->refs[writer->r_count++];
+  memset (ref, 0, sizeof *ref);
+  ref->data = data;
+  ref->size = size;
+  ref->ring_offset = writer->ring_committed + offset;
+
+  writer->ref_queued += size;
+
+  return ref;
+}
+
+bool
+writer_add_reference (ClientWriter *writer, size_t offset,
+  const void *data, size_t size)
+{
+  WriterReference *ref;
+
+  ref = writer_new_reference (writer, offset, data, size);
+  if (ref == NULL)
+    return false;
+
+  ref->notify = data;
+
+  return true;
+}
+
+bool
+writer_add_copy (ClientWriter *writer, size_t offset,
+  const void *data, size_t size)
+{
+  WriterReference *ref;
+  void *copy;
+
+  copy = malloc (size);
+  if (copy == NULL)
+    return false;
+
+  memcpy (copy, data, size);
+
+  ref = writer_new_reference (writer, offset, copy, size);
+  if (ref == NULL)
+    {
+      free (copy);
+      return false;
+    }
+
+  ref->owned = copy;
+
+  return true;
+}
+
+/* Splitting a message into frames needs a header per payload_max bytes
+ * of body. Ring bytes are copied into their frames, references are
+ * split into one reference per frame of which only the last one releases
+ * the memory, so large data arguments are never copied again. */
+bool
+writer_commit_fragmented (ClientWriter *writer, size_t size,
+  size_t total_size, size_t payload_max)
+{
+  size_t body_size = total_size - sizeof(hdr_t);
+  size_t nframes = (body_size + payload_max - 1) / payload_max;
+  uint64_t frame_end = writer->committed;
+  int b_count = writer->b_count;
+  size_t framed_size = size + (nframes - 1) * sizeof(hdr_t) + sizeof(uint32_t);
+  int nrefs = writer->r_count - writer->r_reserved;
+  int ntaken = 0;
+  WriterReference *refs = NULL;
+  uint16_t opcode;
+  uint16_t flags;
+  uint8_t *msg;
+  uint8_t *start;
+  uint8_t *p;
+  size_t ring_off = sizeof(hdr_t);
+  size_t ref_off = 0;
+  size_t left;
+  size_t n;
+  bool first = true;
+  int k;
+
+  /* Take the message and its references out of the buffer, the framed
+   * message is written in their place */
+  msg = malloc (size);
+  if (nrefs > 0)
+    refs = malloc (nrefs * sizeof(WriterReference));
+  if (msg == NULL || (nrefs > 0 && refs == NULL))
+    goto fail;
+
+  memcpy (msg, writer->wp, size);
+  memcpy (&opcode, msg + M_OFFSET_OPCODE, sizeof opcode);
+  memcpy (&flags, msg + M_OFFSET_FLAGS, sizeof flags);
+  for (k = 0; k < nrefs; k++)
+    {
+      refs[k] = writer->refs[writer->r_reserved + k];
+      refs[k].ring_offset -= writer->ring_committed;
+      writer->ref_queued -= refs[k].size;
+    }
+  writer->r_count = writer->r_reserved;
+  ntaken = nrefs;
+
+  start = writer_reserve (writer, framed_size);
+  if (start == NULL)
+    goto fail;
+
+  p = start;
+  k = 0;
+  while (body_size > 0)
+    {
+      size_t payload = body_size < payload_max ? body_size : payload_max;
+      hdr_t hdr = { M_FLAG_FRAGMENT, payload + sizeof(hdr_t), opcode, 0 };
+
+      if (first)
+        {
+          uint32_t length = total_size - sizeof(hdr_t);
+
+          hdr.flags |= M_FLAG_FRAGMENT_FIRST | (flags & M_FLAG_COMPRESSED);
+          hdr.sz += sizeof length;
+          memcpy (p, &hdr, sizeof hdr);
+          memcpy (p + sizeof hdr, &length, sizeof length);
+          p += sizeof hdr + sizeof length;
+          first = false;
+        }
+      else
+        {
+          memcpy (p, &hdr, sizeof hdr);
+          p += sizeof hdr;
+        }
+
+      /* Others may send between the frames, the end of the last one is
+       * the end of the queue */
+      frame_end += hdr.sz;
+      body_size -= payload;
+      if (body_size > 0 && !writer_add_boundary (writer, frame_end))
+        goto fail;
+
+      for (left = payload; left > 0; left -= n)
+        {
+          if (k < nrefs && refs[k].ring_offset == ring_off)
+            {
+              WriterReference *piece;
+
+              n = refs[k].size - ref_off;
+              if (n > left)
+                n = left;
+
+              piece = writer_new_reference (writer, p - start,
+                (const uint8_t *) refs[k].data + ref_off, n);
+              if (piece == NULL)
+                goto fail;
+
+              ref_off += n;
+              if (ref_off == refs[k].size)
+                {
+                  piece->notify = refs[k].notify;
+                  piece->owned = refs[k].owned;
+                  refs[k].notify = NULL;
+                  refs[k].owned = NULL;
+                  ref_off = 0;
+                  k++;
+                }
+            }
+          else
+            {
+              n = (k < nrefs ? refs[k].ring_offset : size) - ring_off;
+              if (n > left)
+                n = left;
+
+              memcpy (p, msg + ring_off, n);
+              p += n;
+              ring_off += n;
+            }
+        }
+    }
+
+  writer_commit (writer, p - start);
+
+  free (refs);
+  free (msg);
+
+  return true;
+
+fail:
+  /* The message is lost, still hand back the memory it referenced */
+  for (k = writer->r_reserved; k < writer->r_count; k++)
+    {
+      writer->ref_queued -= writer->refs[k].size;
+      reference_release (writer, &writer->refs[k]);
+    }
+  writer->r_count = writer->r_reserved;
+  writer->b_count = b_count;
+  for (k = 0; k < ntaken; k++)
+    reference_release (writer, &refs[k]);
+  free (refs);
+  free (msg);
+
+  return false;
+}
+
+/* The compressed message replaces the original one, which is gathered
+ * from the ring and its references first. Large results are queued as a
+ * reference to the compression buffer rather than copied again. */
+bool
+writer_compress (ClientWriter *writer, size_t *size, size_t *total_size)
+{
+  size_t body_size = *total_size - sizeof(hdr_t);
+  size_t bound = COMPRESS_BOUND (body_size);
+  size_t ring_off = 0;
+  size_t msg_off = 0;
+  size_t clen;
+  size_t csize;
+  uint8_t *msg;
+  uint8_t *out;
+  uint8_t *p;
+  uint32_t length = body_size;
+  hdr_t hdr;
+  int k;
+
+  msg = malloc (*total_size);
+  out = malloc (sizeof hdr + sizeof length + bound + 3);
+  if (msg == NULL || out == NULL)
+    goto keep;
+
+  for (k = writer->r_reserved; k < writer->r_count; k++)
+    {
+      WriterReference *ref = &writer->refs[k];
+      size_t n = ref->ring_offset - writer->ring_committed - ring_off;
+
+      memcpy (msg + msg_off, writer->wp + ring_off, n);
+      memcpy (msg + msg_off + n, ref->data, ref->size);
+      ring_off += n;
+      msg_off += n + ref->size;
+    }
+  memcpy (msg + msg_off, writer->wp + ring_off, *size - ring_off);
+
+  clen = compress_block (msg + sizeof hdr, body_size,
+    out + sizeof hdr + sizeof length, bound);
+  csize = (sizeof hdr + sizeof length + clen + 3) & ~(size_t) 3;
+  if (clen == 0 || csize >= *total_size)
+    goto keep;
+
+  memcpy (&hdr, msg, sizeof hdr);
+  hdr.flags |= M_FLAG_COMPRESSED;
+  hdr.sz = csize <= 0xffff ? csize : 0;
+  memcpy (out, &hdr, sizeof hdr);
+  memcpy (out + sizeof hdr, &length, sizeof length);
+  memset (out + sizeof hdr + sizeof length + clen, 0,
+    csize - (sizeof hdr + sizeof length + clen));
+  free (msg);
+
+  /* The data has been copied, the references are done */
+  for (k = writer->r_reserved; k < writer->r_count; k++)
+    {
+      writer->ref_queued -= writer->refs[k].size;
+      reference_release (writer, &writer->refs[k]);
+    }
+  writer->r_count = writer->r_reserved;
+
+  *total_size = csize;
+
+  if (csize < FRAGMENT_PAYLOAD_MAX)
+    {
+      p = writer_reserve (writer, csize);
+      if (p == NULL)
+        {
+          free (out);
+          return false;
+        }
+
+      memcpy (p, out, csize);
+      free (out);
+      *size = csize;
+
+      return true;
+    }
+
+  *size = sizeof hdr + sizeof length;
+  p = writer_reserve (writer, *size);
+  if (p == NULL)
+    {
+      free (out);
+      return false;
+    }
+
+  memcpy (p, out, *size);
+  if (!writer_new_reference (writer, *size, out + *size, csize - *size))
+    {
+      free (out);
+      return false;
+    }
+  writer->refs[writer->r_count - 1].owned = out;
+
+  return true;
+
+keep:
+  free (msg);
+  free (out);
+
+  return true;
+}
+
+uint8_t *
+writer_insert_prefix (ClientWriter *writer, size_t *size,
+  const void *prefix, size_t plen)
+{
+  int r_reserved = writer->r_reserved;
+  uint8_t *msg;
+  uint8_t *p;
+  int k;
+
+  /* The larger reservation may start where the message is now */
+  msg = malloc (*size);
+  if (msg != NULL)
+    memcpy (msg, writer->wp, *size);
+
+  p = msg ? writer_reserve (writer, *size + plen) : NULL;
+  writer->r_reserved = r_reserved;
+  if (p == NULL)
+    {
+      for (k = writer->r_reserved; k < writer->r_count; k++)
+        {
+          writer->ref_queued -= writer->refs[k].size;
+          reference_release (writer, &writer->refs[k]);
+        }
+      writer->r_count = writer->r_reserved;
+      free (msg);
+      return NULL;
+    }
+
+  memcpy (p, msg, sizeof(hdr_t));
+  memcpy (p + sizeof(hdr_t), prefix, plen);
+  memcpy (p + sizeof(hdr_t) + plen, msg + sizeof(hdr_t),
+    *size - sizeof(hdr_t));
+  free (msg);
+
+  for (k = writer->r_reserved; k < writer->r_count; k++)
+    writer->refs[k].ring_offset += plen;
+  *size += plen;
+
+  return p;
+}
+
+static bool
+reference_done (WriterReference *ref)
+{
+  return ref->sent == ref->size && ref->ncompleted == ref->nsends;
+}
+
+/* Hand memory back in stream order, once the kernel is done with it */
+static void
+writer_release_done (ClientWriter *writer)
+{
+  int n = 0;
+
+  while (n < writer->r_unsent && reference_done (&writer->refs[n]))
+    reference_release (writer, &writer->refs[n++]);
+
+  if (n == 0)
+    return;
+
+  memmove (writer->refs, writer->refs + n,
+    (writer->r_count - n) * sizeof(WriterReference));
+  writer->r_count -= n;
+  writer->r_unsent -= n;
+}
+
+static void
+writer_consume (ClientWriter *writer, size_t size)
+{
+  size_t l;
+
+  writer->queued -= size;
+  writer->ring_sent += size;
+  writer->total_written += size;
+
+  if (writer->wrap)
+    {
+      l = writer->wrap - writer->rp;
+      if (size < l)
+        {
+          writer->rp += size;
+          return;
+        }
+
+      writer->rp = writer->ringbuffer + (size - l);
+      writer->wrap = NULL;
+      return;
+    }
 
-static inline uint8_t
-get_uint8 (ClientReader *reader, uint8_t *rp, int offset)
-{
-  return * move_forward (reader, rp, offset);
+  writer->rp += size;
 }
 
-static inline uint16_t
-get_uint16 (ClientReader *reader, uint8_t *rp, int offset)
+bool
+writer_add_fd (ClientWriter *writer, int fd)
 {
-  uint16_t r = get_uint8 (reader, rp, offset + 1);
-  r <<= 8;
-  r +=  get_uint8 (reader, rp, offset);
-
-  return r;
+  return append_fds (&writer->fds, &writer->fd_count, &writer->fd_total,
+                     &fd, 1);
 }
 
-static bool
-get_one_message (ClientReader *reader)
+/* Sends queued file descriptors along with the data */
+static ssize_t
+writer_send (ClientWriter *writer, int fd, struct iovec *vecs, int iocnt,
+  int flags)
 {
-  size_t size;
-  size_t left = bytes_left (reader, reader->rp);
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE (MAX_FDS_PER_SEND * sizeof(int))];
+  int nfds = MIN (writer->fd_count, MAX_FDS_PER_SEND);
+  ssize_t ret;
 
-  if (left < sizeof(hdr_t))
-    return false;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = vecs;
+  msg.msg_iovlen = iocnt;
 
-  size = get_uint16 (reader, reader->rp, M_OFFSET_SIZE);
+  if (nfds > 0)
+    {
+      memset (control, 0, sizeof control);
+      msg.msg_control = control;
+      msg.msg_controllen = CMSG_SPACE (nfds * sizeof(int));
+      cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (nfds * sizeof(int));
+      memcpy (CMSG_DATA (cmsg), writer->fds, nfds * sizeof(int));
+    }
 
-  if (left < size)
-    return false;
+  do {
+    /* A peer disconnecting mid-send must not raise SIGPIPE */
+    ret = sendmsg (fd, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (ret == -1 && errno == EINTR);
 
-  if (size == 0)
+  if (ret > 0 && nfds > 0)
     {
-      wth_error ("Invalid message size (0)");
-      return false;
+      close_fds (writer->fds, nfds);
+      writer->fd_count -= nfds;
+      memmove (writer->fds, writer->fds + nfds,
+        writer->fd_count * sizeof(int));
     }
 
-  reader->messages[reader->m_complete].start = reader->rp;
-  reader->messages[reader->m_complete].length = size;
+  return ret;
+}
 
+/* Send up to limit bytes from the ring */
+static ssize_t
+writer_send_ring (ClientWriter *writer, int fd, size_t limit)
+{
+  struct iovec vecs[2];
+  int iocnt = 1;
+  ssize_t ret;
 
-  if (reader->rp + (READER_MESSAGE_FIELDS * sizeof (uint16_t)) >
-      reader->ringbuffer + reader->ringsize)
+  vecs[0].iov_base = writer->rp;
+  if (writer->wrap)
     {
-      size_t left = reader->ringsize + reader->ringbuffer - reader->rp;
-      uint8_t *base = (uint8_t*)&reader->messages[reader->m_complete].id;
-
-      memcpy (base, reader->rp, left);
-      memcpy (base + left, reader->ringbuffer,
-              (READER_MESSAGE_FIELDS * sizeof (uint16_t)) - left);
+      vecs[0].iov_len = writer->wrap - writer->rp;
+      vecs[1].iov_base = writer->ringbuffer;
+      vecs[1].iov_len = writer->wp - writer->ringbuffer;
+      if (vecs[1].iov_len > 0)
+        iocnt++;
     }
   else
     {
-      memcpy (&reader->messages[reader->m_complete].id,
-        reader->rp, READER_MESSAGE_FIELDS * sizeof (uint16_t));
+      vecs[0].iov_len = writer->wp - writer->rp;
     }
 
-  reader->m_complete++;
+  if (vecs[0].iov_len >= limit)
+    {
+      vecs[0].iov_len = limit;
+      iocnt = 1;
+    }
+  else if (iocnt == 2 && vecs[0].iov_len + vecs[1].iov_len > limit)
+    {
+      vecs[1].iov_len = limit - vecs[0].iov_len;
+    }
 
-  reader->rp = move_forward (reader, reader->rp, size);
+  ret = writer_send (writer, fd, vecs, iocnt, 0);
+  if (ret > 0)
+    writer_consume (writer, ret);
 
-  return true;
+  return ret;
 }
 
-static bool
-reader_fill_ring_buffer (ClientReader *reader, int fd)
+static ssize_t
+writer_send_reference (ClientWriter *writer, int fd, WriterReference *ref,
+  uint64_t limit)
 {
-  struct iovec vecs[2];
-  int iocnt = 1;
+  struct iovec vec;
+  int flags = 0;
   ssize_t ret;
 
-  /* Assuming all messages are sent out before push */
-  assert (reader->m_complete == 0);
+  vec.iov_base = (uint8_t *) ref->data + ref->sent;
+  vec.iov_len = ref->size - ref->sent;
+  if (vec.iov_len > limit)
+    vec.iov_len = limit;
 
-  vecs[0].iov_base = reader->wp;
-  if (reader->rp > reader->wp)
-    {
-      vecs[0].iov_len = reader->rp - reader->wp;
-    }
-  else
+#ifdef MSG_ZEROCOPY
+  if (writer->zerocopy)
+    flags = MSG_ZEROCOPY;
+#endif
+
+  ret = writer_send (writer, fd, &vec, 1, flags);
+  if (ret == -1 && errno == ENOBUFS && flags)
     {
-      vecs[0].iov_len = reader->ringbuffer + reader->ringsize - reader->wp;
-      if (reader->rp >  reader->ringbuffer)
-        {
-          vecs[1].iov_base = reader->ringbuffer;
-          vecs[1].iov_len = reader->rp - reader->ringbuffer;
-          iocnt++;
-        }
+      /* Out of option memory for tracking the pages, copy instead */
+      flags = 0;
+      ret = writer_send (writer, fd, &vec, 1, flags);
     }
-  /* Never let the write pointer  completely catch up with the read pointer */
-  vecs[iocnt - 1].iov_len -= 1;
-
-  ret = readv (fd, vecs, iocnt);
-  if (ret <= 0) {
-    wth_error ("Error while filling buffer: %m");
-    return false;
-  }
-
-  reader->total_read += ret;
 
-  if (iocnt == 1 || ret < (ssize_t) vecs[0].iov_len)
-    reader->wp += ret;
-  else
-    reader->wp = reader->ringbuffer + ret - vecs[0].iov_len;
-
-  assert (reader->wp != reader->rp);
-  return true;
-}
+  if (ret <= 0)
+    return ret;
 
+  if (flags)
+    {
+      if (ref->nsends == 0)
+        ref->first_seq = writer->zc_seq;
+      ref->nsends++;
+      writer->zc_seq++;
+    }
 
-bool
-reader_pull_new_messages (ClientReader *reader, int fd, bool from_client)
-{
-  if (!reader_fill_ring_buffer (reader, fd))
-    return false;
+  ref->sent += ret;
+  writer->ref_queued -= ret;
+  writer->total_written += ret;
 
-  /* Setup message headers */
-  while (get_one_message (reader))
+  if (ref->sent == ref->size)
     {
-      if (reader->m_complete == reader->m_total)
-        {
-          reader->messages = realloc (reader->messages,
-            reader->m_total * 2 * sizeof(ReaderMessage));
-          reader->m_total *= 2;
-          wth_debug ("Updated client to %d messages", reader->m_total);
-        }
+      writer->r_unsent++;
+      writer_release_done (writer);
     }
-  return true;
+
+  return ret;
 }
 
-/* File one message buffer */
-void
-reader_map_message (ClientReader *reader, int m, msg_t *msg)
+/* Send queued data up to stream position end */
+static ssize_t
+writer_flush_until (ClientWriter *writer, int fd, uint64_t end)
 {
-  ReaderMessage *rm;
-  int nc = 0;
-  void *start;
+  WriterReference *ref;
+  ssize_t total = 0;
+  ssize_t ret;
+  uint64_t limit;
 
-  assert (m >= 0 && m < reader->m_complete);
-  memset (msg, 0, sizeof (msg_t));
+  while (writer->total_written < end &&
+         (writer->queued > 0 || writer->r_unsent < writer->r_count))
+    {
+      limit = end - writer->total_written;
 
-  rm = &reader->messages[m];
+      ref = NULL;
+      if (writer->r_unsent < writer->r_count)
+        ref = &writer->refs[writer->r_unsent];
 
-  start = rm->start;
-  if ((rm->start + rm->length)
-      > (reader->ringbuffer + reader->ringsize))
-    {
-      size_t l;
-      while (reader->allocated_bouncesize < rm->length)
+      /* Referenced memory goes out in separate sends, so that only it and
+       * never the reusable ring is handed to the kernel for zero-copy */
+      if (ref && ref->ring_offset == writer->ring_sent)
         {
-          free (reader->bounce);
-          if (reader->allocated_bouncesize == 0)
-            reader->allocated_bouncesize = 2048;
-          else
-            reader->allocated_bouncesize *= 2;
-          reader->bounce = malloc (reader->allocated_bouncesize);
+          ret = writer_send_reference (writer, fd, ref, limit);
         }
-      /* split message, simply copy the whole message to a bounce buffer  */
-      l = (reader->ringbuffer + reader->ringsize) - rm->start;
-      memcpy (reader->bounce, rm->start, l);
-      memcpy (reader->bounce + l, reader->ringbuffer, rm->length - l);
-      start = reader->bounce;
-    }
+      else
+        {
+          if (ref && ref->ring_offset - writer->ring_sent < limit)
+            limit = ref->ring_offset - writer->ring_sent;
+          else if (writer->queued < limit)
+            limit = writer->queued;
 
-  /* Whole message is now linearly in memory from start */
-  msg->hdr = start;
-  msg->body = start + sizeof(hdr_t);
-  if (rm->length > msg->hdr->sz)
-    {
-      msg->chunks[nc].data = start + msg->hdr->sz;
-      msg->chunks[nc].size = rm->length - msg->hdr->sz;
-      nc++;
-    }
+          ret = writer_send_ring (writer, fd, limit);
+        }
 
-  /* Grab data from the readers tail if applicable */
-  if (m + 1 == reader->m_complete && reader->tailsize)
-    {
-      msg->chunks[nc].data = (void *)reader->tail;
-      msg->chunks[nc].size = reader->tailsize;
+      if (ret == -1)
+        return -1;
+
+      total += ret;
     }
+
+  return total;
 }
 
-void
-reader_unmap_message (ClientReader *reader, int m, msg_t *msg)
+ssize_t
+writer_flush (ClientWriter *writer, int fd)
 {
+  return writer_flush_until (writer, fd, UINT64_MAX);
 }
 
-bool
-reader_forward_message_range (ClientReader *reader, int fd, int s, int e)
+void
+writer_next_unit (ClientWriter *writer)
 {
-  struct iovec vecs[3];
-  int iocnt = 1;
-  ssize_t ret;
-  uint8_t *start;
-  uint8_t *end;
-
-  assert (s <= e && e < reader->m_complete);
-
-  start = reader->messages[s].start;
-  end = move_forward (reader, reader->messages[e].start,
-    reader->messages[e].length);
-
-  assert (reader->m_complete > 0);
+  int n = 0;
 
-  memset (vecs, 0, 3 * sizeof(struct iovec));
-  vecs[0].iov_base = start;
-  if (end > start)
-    {
-      vecs[0].iov_len = end - start;
-    }
-  else
-    {
-      vecs[0].iov_len = reader->ringbuffer + reader->ringsize - start;
-      vecs[1].iov_base = reader->ringbuffer;
-      vecs[1].iov_len = end - reader->ringbuffer;
-      if (vecs[1].iov_len > 0)
-        iocnt++;
-    }
+  while (n < writer->b_count && writer->boundaries[n] <= writer->total_written)
+    n++;
 
-  if (e == (reader->m_complete -1) && reader->tailsize != 0)
+  if (n > 0)
     {
-      vecs[iocnt].iov_base = reader->tail;
-      vecs[iocnt].iov_len = reader->tailsize;
-      iocnt++;
+      memmove (writer->boundaries, writer->boundaries + n,
+        (writer->b_count - n) * sizeof(uint64_t));
+      writer->b_count -= n;
     }
 
-  ret = writev (fd, vecs, iocnt);
-
-  return ret == (ssize_t)(vecs[0].iov_len + vecs[1].iov_len + vecs[2].iov_len);
+  if (writer->b_count > 0)
+    writer->unit_end = writer->boundaries[0];
+  else
+    writer->unit_end = writer->committed;
+}
 
+ssize_t
+writer_flush_unit (ClientWriter *writer, int fd)
+{
+  return writer_flush_until (writer, fd, writer->unit_end);
 }
 
 void
-reader_flush (ClientReader *reader)
+writer_reap_completions (ClientWriter *writer, int fd)
 {
-  /* Micro-optimisation.. In most cases the message handling will have
-   * handled the full ringbuffer (e.g. the readv call read in upto the message
-   * boundaries). In that case reset the read & write pointers to the
-   * ringbuffer start, such that the next read won't wrap around trigger a need
-   * for using the bounce buffer (and hence an extra memcpy) */
-  if (reader->wp == reader->rp)
-    reader->wp = reader->rp = reader->ringbuffer;
-  reader->m_complete = 0;
-  reader->tailsize = 0;
+#if defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 2];
+  struct sock_extended_err *serr;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  uint32_t lo, hi;
+  int i;
+
+  while (writer->r_count > 0)
+    {
+      memset (&msg, 0, sizeof msg);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof control;
+
+      if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        break;
+
+      for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+        {
+          if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            continue;
+
+          serr = (struct sock_extended_err *) CMSG_DATA (cm);
+          if (serr->ee_errno != 0 ||
+              serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+
+          /* Sends ee_info up to ee_data are complete */
+          lo = serr->ee_info;
+          hi = serr->ee_data;
+
+          for (i = 0; i < writer->r_count; i++)
+            {
+              WriterReference *ref = &writer->refs[i];
+              uint32_t first, last;
+
+              if (ref->nsends == 0)
+                continue;
+
+              first = ref->first_seq;
+              last = ref->first_seq + ref->nsends - 1;
+              if ((int32_t)(hi - first) < 0 || (int32_t)(last - lo) < 0)
+                continue;
+
+              if ((int32_t)(lo - first) > 0)
+                first = lo;
+              if ((int32_t)(last - hi) > 0)
+                last = hi;
+
+              ref->ncompleted += last - first + 1;
+            }
+        }
+    }
+
+  writer_release_done (writer);
+#endif
 }
 
 bool
-reader_forward_all_messages (ClientReader *reader, int fd)
+writer_zerocopy_pending (ClientWriter *writer)
 {
-  bool ret;
+  int i;
 
-  ret = reader_forward_message_range (reader, fd, 0, reader->m_complete - 1);
-
-  reader_flush (reader);
+  for (i = 0; i < writer->r_count; i++)
+    if (writer->refs[i].ncompleted != writer->refs[i].nsends)
+      return true;
 
-  return ret;
+  return false;
 }
 
 bool
@@ -400,6 +2328,7 @@ copy_msg (msg_t *msg)
 
   m->body = (char *)m->hdr + sizeof(hdr_t);
   memcpy (m->body, msg->body, msg->hdr->sz - sizeof (hdr_t));
+  m->length = msg->length;
 
   dsize = m->chunks[0].size + m->chunks[1].size;
   if (dsize > 0)
@@ -470,41 +2399,341 @@ connect_to_unix_socket (const char *path)
 int
 connect_to_host (const char *host, const char *port)
 {
-  int flag = 1;
+  HostConnector *c;
+  struct pollfd pfd;
   int fd;
-  int ret;
+
+  c = new_connector (host, port);
+  if (c == NULL)
+    return -1;
+
+  pfd.fd = c->fd;
+  pfd.events = POLLIN;
+
+  while ((fd = connector_dispatch (c)) < 0 && errno == EINPROGRESS)
+    {
+      if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+        break;
+    }
+
+  free_connector (c);
+
+  return fd;
+}
+
+static struct addrinfo *
+find_address (struct addrinfo *r, int family, bool same)
+{
+  while (r != NULL && (r->ai_family == family) != same)
+    r = r->ai_next;
+
+  return r;
+}
+
+/* Alternate address families, keeping the order of getaddrinfo()
+ * within each family, so that a broken family costs at most one
+ * attempt delay (RFC 8305, section 4) */
+static void
+connector_sort_addresses (HostConnector *c)
+{
+  int family = c->res->ai_family;
+  struct addrinfo *p = c->res;
+  struct addrinfo *q = find_address (c->res, family, false);
+  int n = 0;
+
+  while (p != NULL || q != NULL)
+    {
+      if (p != NULL)
+        {
+          c->addrs[n++] = p;
+          p = find_address (p->ai_next, family, true);
+        }
+      if (q != NULL)
+        {
+          c->addrs[n++] = q;
+          q = find_address (q->ai_next, family, false);
+        }
+    }
+}
+
+static void
+connector_arm_timer (HostConnector *c, int ms)
+{
+  struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  timerfd_settime (c->timer_fd, 0, &its, NULL);
+}
+
+static void
+connector_close_attempt (HostConnector *c, int i)
+{
+  epoll_ctl (c->fd, EPOLL_CTL_DEL, c->attempts[i], NULL);
+  close (c->attempts[i]);
+  c->attempts[i] = -1;
+  c->pending--;
+}
+
+/* Start connecting to the next address. Returns the socket if it
+ * connected right away, -1 otherwise. */
+static int
+connector_start_next (HostConnector *c)
+{
+  struct epoll_event ev;
+  struct addrinfo *r;
+  int fd;
+
+  while (c->next < c->n_addrs)
+    {
+      int i = c->next++;
+
+      r = c->addrs[i];
+      fd = socket (r->ai_family, r->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   r->ai_protocol);
+      if (fd == -1)
+        {
+          c->error = errno;
+          continue;
+        }
+
+      if (connect (fd, r->ai_addr, r->ai_addrlen) == 0)
+        return fd;
+
+      if (errno != EINPROGRESS)
+        {
+          c->error = errno;
+          close (fd);
+          continue;
+        }
+
+      ev.events = EPOLLOUT;
+      ev.data.u32 = i;
+      if (epoll_ctl (c->fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+          c->error = errno;
+          close (fd);
+          continue;
+        }
+
+      c->attempts[i] = fd;
+      c->pending++;
+
+      /* Give it a head start before racing the next address */
+      if (c->next < c->n_addrs)
+        connector_arm_timer (c, CONNECT_ATTEMPT_DELAY_MS);
+
+      break;
+    }
+
+  return -1;
+}
+
+/* Allocate what the attempts need once the addresses are known */
+static bool
+connector_init (HostConnector *c)
+{
+  struct epoll_event ev;
+  struct addrinfo *r;
+  int i;
+
+  for (r = c->res; r != NULL; r = r->ai_next)
+    c->n_addrs++;
+
+  c->addrs = calloc (c->n_addrs, sizeof *c->addrs);
+  c->attempts = malloc (c->n_addrs * sizeof *c->attempts);
+  c->fd = epoll_create1 (EPOLL_CLOEXEC);
+  c->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (c->addrs == NULL || c->attempts == NULL ||
+      c->fd < 0 || c->timer_fd < 0)
+    return false;
+
+  for (i = 0; i < c->n_addrs; i++)
+    c->attempts[i] = -1;
+  connector_sort_addresses (c);
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = UINT32_MAX;
+  if (epoll_ctl (c->fd, EPOLL_CTL_ADD, c->timer_fd, &ev) < 0)
+    return false;
+
+  c->error = ECONNREFUSED;
+
+  return true;
+}
+
+HostConnector *
+new_connector (const char *host, const char *port)
+{
   struct addrinfo hints = { 0, };
-  struct addrinfo *res, *r;
+  HostConnector *c;
+  int ret;
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL)
+    return NULL;
+
+  c->fd = -1;
+  c->timer_fd = -1;
 
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = IPPROTO_TCP;
 
-  ret = getaddrinfo (host, port, &hints, &res);
-  if (ret < 0)
+  ret = getaddrinfo (host, port, &hints, &c->res);
+  if (ret != 0)
     {
       wth_error ("Connect to %s port %s failed (getaddrinfo: %s)",
-        host, port,
-        strerror(errno));
-      return -1;
+        host, port, gai_strerror (ret));
+      free (c);
+      errno = ENXIO;
+      return NULL;
     }
 
-  for (r = res; r != NULL ; r = r->ai_next)
+  if (!connector_init (c))
     {
-      fd = socket (r->ai_family, r->ai_socktype, r->ai_protocol);
-      if (fd == -1)
-        continue;
+      free_connector (c);
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  return c;
+}
+
+HostConnector *
+new_peer_connector (int sockfd)
+{
+  HostConnector *c;
 
-      if (connect (fd, r->ai_addr, r->ai_addrlen) != -1)
-        break; /* success */
+  c = calloc (1, sizeof *c);
+  if (c == NULL)
+    return NULL;
 
-      close (fd);
-      fd = -1;
+  c->fd = -1;
+  c->timer_fd = -1;
+
+  c->peer_len = sizeof c->peer_addr;
+  if (getpeername (sockfd, (struct sockaddr *) &c->peer_addr,
+                   &c->peer_len) < 0)
+    {
+      free (c);
+      return NULL;
+    }
+
+  c->peer.ai_family = c->peer_addr.ss_family;
+  c->peer.ai_socktype = SOCK_STREAM;
+  c->peer.ai_addr = (struct sockaddr *) &c->peer_addr;
+  c->peer.ai_addrlen = c->peer_len;
+  c->res = &c->peer;
+
+  if (!connector_init (c))
+    {
+      free_connector (c);
+      errno = ENOMEM;
+      return NULL;
     }
 
+  return c;
+}
+
+void
+free_connector (HostConnector *c)
+{
+  int i;
+
+  for (i = 0; i < c->n_addrs && c->attempts; i++)
+    if (c->attempts[i] >= 0)
+      close (c->attempts[i]);
+
+  if (c->timer_fd >= 0)
+    close (c->timer_fd);
+  if (c->fd >= 0)
+    close (c->fd);
+
+  free (c->attempts);
+  free (c->addrs);
+  if (c->res != &c->peer)
+    freeaddrinfo (c->res);
+  free (c);
+}
+
+/* Hand out a connected socket, blocking like connect_to_host() always
+ * returned it */
+static int
+connector_finish (HostConnector *c, int fd)
+{
+  int flag = 1;
+  int i;
 
-  if (fd != -1)
-    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+  for (i = 0; i < c->n_addrs; i++)
+    if (c->attempts[i] == fd)
+      {
+        epoll_ctl (c->fd, EPOLL_CTL_DEL, fd, NULL);
+        c->attempts[i] = -1;
+        c->pending--;
+      }
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
 
   return fd;
 }
+
+int
+connector_dispatch (HostConnector *c)
+{
+  struct epoll_event ev[8];
+  uint64_t expirations;
+  socklen_t len;
+  int count, err, fd, i;
+
+  /* The first attempt */
+  if (c->next == 0)
+    {
+      fd = connector_start_next (c);
+      if (fd >= 0)
+        return connector_finish (c, fd);
+    }
+
+  count = epoll_wait (c->fd, ev, ARRAY_LENGTH (ev), 0);
+  if (count < 0)
+    return -1;
+
+  for (i = 0; i < count; i++)
+    {
+      if (ev[i].data.u32 == UINT32_MAX)
+        {
+          if (read (c->timer_fd, &expirations, sizeof expirations) < 0)
+            continue;
+        }
+      else
+        {
+          fd = c->attempts[ev[i].data.u32];
+          if (fd < 0)
+            continue;
+
+          len = sizeof err;
+          if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+          if (err == 0)
+            return connector_finish (c, fd);
+
+          c->error = err;
+          connector_close_attempt (c, ev[i].data.u32);
+        }
+
+      /* The delay is over or an attempt failed: race the next address */
+      fd = connector_start_next (c);
+      if (fd >= 0)
+        return connector_finish (c, fd);
+    }
+
+  if (c->pending == 0 && c->next == c->n_addrs)
+    {
+      errno = c->error;
+      return -1;
+    }
+
+  errno = EINPROGRESS;
+  return -1;
+}
@@ -26,22 +26,77 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
 
 struct wth_connection;
 
-#define M_OFFSET_MSG_ID 0
+#define M_OFFSET_FLAGS 0
 #define M_OFFSET_SIZE 2
 #define M_OFFSET_OPCODE 4
 
-/* XXX id is unused, remove it */
 typedef struct __attribute__((__packed__)) hdr_t {
-   unsigned short id;
+   unsigned short flags;
    unsigned short sz;
    unsigned short opcode;
    unsigned short pad;
 } hdr_t;
 #define MESSAGE_MAX_SIZE (0xffff - sizeof (hdr_t))
 
+/* Messages bigger than a 16-bit size allows are split into frames. The
+ * first frame carries the total body size as a uint32 before its share of
+ * the body, the others only body bytes. All frames of a message carry its
+ * opcode, other messages may be sent in between. Peers that never send
+ * big messages always send 0 flags. */
+#define M_FLAG_FRAGMENT_FIRST 0x1
+#define M_FLAG_FRAGMENT 0x2
+
+/* The body is a uint32 with its decompressed size, followed by the
+ * compressed body and padding. Only sent to peers that announced
+ * wth_display version 2. Set on the first frame of fragmented
+ * messages. */
+#define M_FLAG_COMPRESSED 0x4
+
+/* Data arguments of the message were sent on a side channel. The body
+ * starts with a uint32 count and that many triples of uint32: data id,
+ * offset in the original body and size. The original body follows,
+ * without those data bytes and their padding. Only sent to peers that announced
+ * wth_display version 3, never on fragments. */
+#define M_FLAG_BULK 0x8
+
+/* Body bytes per frame, keeping frames a multiple of 4 bytes */
+#define FRAGMENT_PAYLOAD_MAX \
+   ((MESSAGE_MAX_SIZE - sizeof (uint32_t)) & ~(size_t) 3)
+
+/* Receive ring sizes, powers of two. The ring starts small, grows while
+ * the socket fills it and shrinks after READER_SHRINK_PERIODS idle
+ * periods in which it was mostly unused. */
+#define READER_RING_MIN_SIZE 4096
+#define READER_RING_DEFAULT_MAX (128 * 1024)
+#define READER_RING_MAX_SIZE (16 * 1024 * 1024)
+#define READER_SHRINK_PERIODS 16
+#define READER_MESSAGES_INITIAL 16
+
+/* Upper limit for the size of a reassembled message */
+#define MESSAGE_MAX_REASSEMBLED_SIZE (256 * 1024 * 1024)
+
+/* Scheduling class of an outgoing message, from the priority attribute
+ * in the protocol XML. Input messages are queued separately and may
+ * overtake others between messages or frames. Control and bulk messages
+ * keep their order, as later requests may refer to objects created by
+ * bulk ones, but bulk messages are sent in slices of BULK_SLICE_SIZE. */
+enum message_priority {
+  MESSAGE_PRIORITY_INPUT,
+  MESSAGE_PRIORITY_CONTROL,
+  MESSAGE_PRIORITY_BULK,
+};
+
+#define BULK_SLICE_SIZE 16384
+
+/* File descriptors passed with one sendmsg, over AF_UNIX sockets only */
+#define MAX_FDS_PER_SEND 28
+
 typedef struct data_t {
    unsigned int sz;
    void *data;
@@ -50,6 +105,7 @@ typedef struct data_t {
 typedef struct {
   hdr_t *hdr;
   char *body;
+  size_t length; /* header included, also where hdr->sz is 0 */
   struct chunk {
     char *data;
     size_t size;
@@ -72,32 +128,54 @@ msg_dispatch (struct wth_connection *conn, msg_t *msg);
 typedef struct {
   uint8_t *start;
   ssize_t length;
-  uint16_t id;
+  uint8_t *reassembled; /* owned buffer of a fragmented or compressed
+                         * message, or NULL */
+  uint16_t flags;
   uint16_t sz;
   uint16_t opcode;
   uint16_t pad;
 } ReaderMessage;
 
-/* number of uint16_t fields, starting from id, in ReaderMessage */
+/* number of uint16_t fields, starting from flags, in ReaderMessage */
 #define READER_MESSAGE_FIELDS 4
 
 typedef struct {
-  uint8_t *ringbuffer;
-  ssize_t ringsize;
+  uint8_t *ringbuffer; /* followed by a mirror of itself, NULL while idle */
+  ssize_t ringsize; /* also while idle, the size to take next */
+  size_t ring_min;
+  size_t ring_max;
+  size_t ring_peak; /* most bytes held since the ring was taken */
+  int quiet_periods; /* idle periods in a row that used little of it */
   uint8_t *rp; /* read pointer */
   uint8_t *wp; /* write pointer */
-  ReaderMessage *messages; /* complete messages in the  ring */
+  ReaderMessage *messages; /* messages parsed ahead of dispatching */
   int m_complete;
+  int m_next; /* first one not yet handed out by reader_next_message() */
+  bool parsed_ahead; /* dispatching stops after the parsed messages */
   int m_total; /* total number of message slots */
 
-  /* potential data tail */
+  /* fragmented message being reassembled: hdr_t followed by the body */
   uint8_t *tail;
   ssize_t tailsize;
   ssize_t allocated_tailsize;
+  ssize_t taillength; /* complete size, 0 when not reassembling */
 
-  /* mapping bounce buffer */
-  uint8_t *bounce;
-  ssize_t allocated_bouncesize;
+  /* file descriptors received and not yet taken, in order */
+  int *fds;
+  int fd_count;
+  int fd_total;
+
+  /* data arguments received on the side channel, in increasing id
+   * order from b_first on. Referenced ones have no data left. */
+  struct bulk_data {
+    uint32_t id;
+    uint8_t *data;
+    size_t size;
+  } *bulk;
+  int b_first;
+  int b_count;
+  int b_total;
+  size_t b_bytes; /* held for entries not yet referenced */
 
   /* Stats */
   size_t total_read;
@@ -107,11 +185,32 @@ typedef struct {
 ClientReader *new_reader (void);
 void free_reader (ClientReader *reader);
 
-bool reader_pull_new_messages (ClientReader *reader, int fd,
-  bool from_client);
+/* Bounds for the ring size, rounded up to powers of two. The largest
+ * message must fit. */
+void reader_set_ring_limits (ClientReader *reader, size_t min_size,
+  size_t max_size);
+
+/* Read until the socket has nothing more, or max_bytes have been read
+ * or max_messages are complete, when not 0. Returns 1 when more data is
+ * probably waiting, 0 when not and -1 on error. */
+int reader_pull_new_messages (ClientReader *reader, int fd, size_t max_bytes,
+  int max_messages);
+
+/* Find the complete messages in the ring ahead of dispatching, up to
+ * max_messages if not 0. Until they are all dispatched, only they are. */
+bool reader_parse_messages (ClientReader *reader, int max_messages);
+
+/* The next message to dispatch: the ones parsed ahead first, then
+ * straight from the ring. Returns 1 with msg set, 0 when no complete
+ * message is left or the next one waits for side channel data, and -1
+ * on a malformed stream. The messages stay valid until
+ * reader_release_messages(). */
+int reader_next_message (ClientReader *reader, msg_t *msg);
+
+/* Forget the messages handed out by reader_next_message() */
+void reader_release_messages (ClientReader *reader);
 
 void reader_map_message (ClientReader *reader, int m, msg_t *msg);
-void reader_unmap_message (ClientReader *reader, int m, msg_t *msg);
 
 /* Forward complete messages */
 bool reader_forward_message_range (ClientReader *reader, int fd,
@@ -119,8 +218,190 @@ bool reader_forward_message_range (ClientReader *reader, int fd,
 bool reader_forward_all_messages (ClientReader *reader, int fd);
 void reader_flush (ClientReader *reader);
 
+/* The oldest received file descriptor, now owned by the caller, or -1 */
+int reader_take_fd (ClientReader *reader);
+
+/* Keep a copy of a data argument that arrived on the side channel, until
+ * the message referencing it is parsed. Fails with EINVAL if the id is
+ * not above the previous one, ENOBUFS if more than
+ * MESSAGE_MAX_REASSEMBLED_SIZE bytes would be held, or ENOMEM. */
+bool reader_add_bulk_data (ClientReader *reader, uint32_t id,
+  const void *data, size_t size);
+
+/**** Ringbuffer based network writer */
+
+/* Caller memory sent in place of ring bytes (zero-copy data arguments) */
+typedef struct {
+  const void *data;
+  size_t size;
+  size_t sent;
+  void *owned; /* copy made by the writer, freed when done */
+  const void *notify; /* passed to the release function when done */
+  uint64_t ring_offset; /* sent after this many ring bytes in total */
+  uint32_t first_seq; /* MSG_ZEROCOPY sequence of the first send */
+  uint32_t nsends; /* number of MSG_ZEROCOPY sends */
+  uint32_t ncompleted; /* number of those the kernel has completed */
+} WriterReference;
+
+typedef void (*writer_release_func_t) (const void *data, void *user_data);
+
+/* A queued message, tracked for coalescing */
+typedef struct {
+  uint64_t ring_offset; /* position of the message in the ring stream */
+  uint32_t object;
+  uint32_t key;
+  uint16_t opcode;
+  uint16_t size;
+  bool coalescible;
+} WriterMessage;
+
+typedef struct {
+  uint8_t *ringbuffer;
+  ssize_t ringsize;
+  uint8_t *rp; /* read pointer, next byte to send */
+  uint8_t *wp; /* write pointer */
+  /* When the write pointer has wrapped around before the read pointer,
+   * end of the data still to be sent from rp. NULL otherwise. */
+  uint8_t *wrap;
+  size_t queued; /* bytes waiting to be sent */
+  uint64_t ring_committed; /* ring bytes ever queued */
+  uint64_t ring_sent; /* ring bytes ever sent */
+
+  /* References to caller memory, in stream order */
+  WriterReference *refs;
+  int r_count;
+  int r_total;
+  int r_unsent; /* first reference not completely sent */
+  int r_reserved; /* first reference of the message being reserved */
+  size_t ref_queued; /* referenced bytes waiting to be sent */
+
+  /* Stream positions, counting ring and referenced bytes */
+  uint64_t committed; /* end of the queued data */
+  uint64_t unit_end; /* sending must not be interrupted before this */
+  uint64_t *boundaries; /* where others may send in between */
+  int b_count;
+  int b_total;
+
+  /* Queued messages, when coalescing */
+  bool coalesce;
+  WriterMessage *msgs;
+  int m_count;
+  int m_total;
+
+  /* File descriptors to send with the next sendmsg, owned */
+  int *fds;
+  int fd_count;
+  int fd_total;
+
+  bool zerocopy;
+  uint32_t zc_seq; /* sequence number of the next MSG_ZEROCOPY send */
+  writer_release_func_t release;
+  void *release_data;
+
+  /* Stats, and the stream position of the next byte to send */
+  uint64_t total_written;
+} ClientWriter;
+
+ClientWriter *new_writer (void);
+void free_writer (ClientWriter *writer);
+
+size_t writer_queued (ClientWriter *writer);
+
+/* Contiguous space for one message of size bytes, without syscalls */
+bool writer_has_space (ClientWriter *writer, size_t size);
+uint8_t *writer_reserve (ClientWriter *writer, size_t size);
+void writer_commit (ClientWriter *writer, size_t size);
+
+/* Commit a message that supersedes an unsent one with the same object,
+ * opcode and key, unless a message for the object that is not
+ * coalescible is in between. The earlier message is overwritten in
+ * place if it has the same size. */
+void writer_commit_coalescible (ClientWriter *writer, size_t size,
+  uint32_t key);
+
+void writer_set_coalesce (ClientWriter *writer, bool coalesce);
+
+/* Send fd, taking ownership of it, along with the queued data. It
+ * reaches the peer no later than the message being reserved. */
+bool writer_add_fd (ClientWriter *writer, int fd);
+
+/* Send size bytes of data from caller memory at offset bytes into the
+ * message being reserved, instead of copying them into the ring */
+bool writer_add_reference (ClientWriter *writer, size_t offset,
+  const void *data, size_t size);
+
+/* Like writer_add_reference(), but from a private copy of data */
+bool writer_add_copy (ClientWriter *writer, size_t offset,
+  const void *data, size_t size);
+
+/* Commit a reserved message of total_size bytes on the wire, of which
+ * size bytes are in the ring, splitting it into frames of at most
+ * payload_max body bytes */
+bool writer_commit_fragmented (ClientWriter *writer, size_t size,
+  size_t total_size, size_t payload_max);
+
+/* Replace the reserved message of total_size bytes on the wire, of which
+ * size bytes are in the ring, by its compressed form if that is smaller,
+ * updating both sizes. Returns false if the message was lost. */
+bool writer_compress (ClientWriter *writer, size_t *size,
+  size_t *total_size);
+
+/* Insert plen bytes of prefix between the header and the body of the
+ * reserved message of size bytes in the ring, updating size. Returns the
+ * message, or NULL if it was lost. */
+uint8_t *writer_insert_prefix (ClientWriter *writer, size_t *size,
+  const void *prefix, size_t plen);
+
+/* Send as much as possible without blocking */
+ssize_t writer_flush (ClientWriter *writer, int fd);
+
+/* Start the next unit to send without interruption: one frame of a
+ * fragmented message, or whole messages up to the next boundary */
+void writer_next_unit (ClientWriter *writer);
+
+/* Send what is left of the current unit */
+ssize_t writer_flush_unit (ClientWriter *writer, int fd);
+
+/* Release references whose zero-copy sends the kernel has completed */
+void writer_reap_completions (ClientWriter *writer, int fd);
+
+/* Whether the kernel may still read memory of zero-copy sends */
+bool writer_zerocopy_pending (ClientWriter *writer);
+
 /** Network helpers */
 int connect_to_host (const char *host, const char *port);
 int connect_to_unix_socket (const char *path);
 
+/* Delay before racing the next address of a host (RFC 8305) */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/* Non-blocking connection to a host, trying its addresses in parallel */
+typedef struct {
+  int fd; /* epoll fd, readable when the connector needs dispatching */
+  int timer_fd; /* expires when the next attempt is due */
+  struct addrinfo *res;
+  struct addrinfo **addrs; /* address families interleaved */
+  int *attempts; /* socket per address, -1 when not connecting */
+  int n_addrs;
+  int next; /* next address to try */
+  int pending; /* attempts in flight */
+  int error; /* error of the last failed attempt */
+
+  /* The only address of a peer connector, in place of res */
+  struct addrinfo peer;
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_len;
+} HostConnector;
+
+HostConnector *new_connector (const char *host, const char *port);
+
+/* Another connection to the address the socket is connected to */
+HostConnector *new_peer_connector (int sockfd);
+void free_connector (HostConnector *c);
+
+/* The first call starts connecting. Returns the connected socket, or
+ * -1 with errno EINPROGRESS while attempts are pending, or another
+ * errno once all of them failed. */
+int connector_dispatch (HostConnector *c);
+
 #endif
@@ -24,11 +24,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/random.h>
+#include <time.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "message.h"
 #include "marshaller.h"
@@ -41,15 +46,74 @@
 struct wth_connection {
 	int fd;
 	enum wth_connection_side side;
+	HostConnector *connector; /* while connecting, fd is its fd */
 
 	ClientReader *reader;
+	ClientWriter *writer;
+	ClientWriter *input_writer; /* input messages, may overtake writer */
+	bool pass_fds; /* AF_UNIX socket, file descriptors can be sent */
+	int cork;
 	int error;
+	uint32_t peer_version; /* wth_display version of the peer */
 	struct {
 		uint32_t code;
 		uint32_t id;
 		const char *interface;
 	} protocol_error;
 
+	struct {
+		size_t low;
+		size_t high;
+		bool congested;
+		wth_watermark_callback_func callback;
+		void *user_data;
+	} watermark;
+
+	struct {
+		size_t threshold;
+		wth_zerocopy_release_func release;
+		void *user_data;
+	} zerocopy;
+
+	struct {
+		size_t threshold;
+	} compression;
+
+	struct {
+		size_t bytes;
+		int messages;
+	} read_budget;
+
+	struct {
+		size_t threshold;
+		/* The side channel, or on a side channel the connection
+		 * it is bound to */
+		struct wth_connection *conn;
+		bool is_side;
+		bool bound; /* the server has accepted the side channel */
+		uint64_t token; /* offered to the client, not yet bound */
+		struct wth_connection *next_offer;
+		uint32_t next_id;
+		/* Data arguments of the message being reserved sent on the
+		 * side channel: their count, then id, offset and size each */
+		uint32_t *descs;
+		int d_count;
+		int d_total;
+		/* bytes of the message so far not in the output buffer */
+		size_t external;
+		size_t diverted; /* of which left out for the side channel */
+	} bulk;
+
+	struct {
+		size_t user_size;
+		/* free blocks of each size class, linked through their
+		 * first bytes */
+		void *free[WTH_OBJECT_SLAB_CLASSES + 1];
+		struct wth_array chunks; /* void *, all slab memory */
+		bool destroy_hooks; /* some object has had one */
+		bool tearing_down; /* in wth_connection_destroy() */
+	} objects;
+
 	struct wth_display *display;
 	struct wth_map map;
 	wth_registry_callback_func registry_callback;
@@ -71,6 +135,92 @@ wth_connect_to_server(const char *host, const char *port)
 	return conn;
 }
 
+/* Returns 0 once connected, -1 with errno EINPROGRESS while connecting */
+static int
+connection_continue_connect(struct wth_connection *conn)
+{
+	int fd;
+
+	fd = connector_dispatch(conn->connector);
+	if (fd < 0) {
+		if (errno != EINPROGRESS)
+			wth_connection_set_error(conn, errno);
+		return -1;
+	}
+
+	wth_debug("%s: connected on fd %d", __func__, fd);
+
+	free_connector(conn->connector);
+	conn->connector = NULL;
+	conn->fd = fd;
+
+	return 0;
+}
+
+/* A client connection that forms while it is flushed and read */
+static struct wth_connection *
+connection_from_connector(HostConnector *c)
+{
+	struct wth_connection *conn;
+
+	conn = wth_connection_from_fd(c->fd, WTH_CONNECTION_SIDE_CLIENT);
+	if (conn == NULL) {
+		free_connector(c);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	conn->connector = c;
+
+	/* Start the first attempt */
+	if (connection_continue_connect(conn) < 0 && errno != EINPROGRESS) {
+		wth_connection_destroy(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+WTH_EXPORT struct wth_connection *
+wth_connect_to_server_async(const char *host, const char *port)
+{
+	HostConnector *c;
+
+	c = new_connector(host, port);
+	if (c == NULL)
+		return NULL;
+
+	return connection_from_connector(c);
+}
+
+WTH_EXPORT int
+wth_connection_finish_connect(struct wth_connection *conn)
+{
+	if (conn->connector == NULL)
+		return 0;
+
+	if (conn->error) {
+		errno = conn->error;
+		return -1;
+	}
+
+	return connection_continue_connect(conn);
+}
+
+WTH_EXPORT struct wth_connection *
+wth_connect_to_unix_socket(const char *name)
+{
+	struct wth_connection *conn = NULL;
+	int fd;
+
+	fd = connect_to_unix_socket(name);
+
+	if (fd >= 0)
+		conn = wth_connection_from_fd(fd, WTH_CONNECTION_SIDE_CLIENT);
+
+	return conn;
+}
+
 WTH_EXPORT struct wth_connection *
 wth_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
@@ -102,26 +252,110 @@ display_error(struct wth_display *d, struct wth_object *obj,
 static void
 display_delete_id(struct wth_display *d, uint32_t id)
 {
-	fprintf(stderr, "wth_display.delete_id(%d)\n", id);
+	struct wth_connection *conn;
+	struct wth_object *obj;
+
+	conn = wth_object_get_user_data((struct wth_object *)d);
+	wth_debug("wth_display.delete_id(%d)", id);
+
+	/* Only IDs this side allocated, and never the display's */
+	if (id <= 1 || id >= WTH_SERVER_ID_START)
+		return;
+
+	/* The ID is free once the object is gone on both sides */
+	obj = wth_map_lookup(&conn->map, id);
+	if (obj)
+		obj->id_deleted = true;
+	else
+		wth_map_remove(&conn->map, id);
 }
 
 static void
 display_server_version(struct wth_display *d, uint32_t ver)
 {
-	fprintf(stderr, "wth_display.server_version(%d)\n", ver);
+	struct wth_connection *conn;
+
+	conn = wth_object_get_user_data((struct wth_object *)d);
+	wth_debug("wth_display.server_version(%d)", ver);
+
+	/* Older servers do not know the request, only answer servers
+	 * that announce their version. */
+	conn->peer_version = ver;
+	wth_display_client_version(d, WTH_DISPLAY_VERSION);
+}
+
+static void
+bulk_bound_handle_done(struct wthp_callback *cb, uint32_t arg)
+{
+	struct wth_connection *conn;
+
+	conn = wth_object_get_user_data((struct wth_object *)cb);
+	wth_debug("The side channel of %p is bound", conn);
+
+	conn->bulk.bound = true;
+	wthp_callback_free(cb);
+}
+
+static const struct wthp_callback_listener bulk_bound_listener = {
+	bulk_bound_handle_done
+};
+
+static void
+display_bulk_channel(struct wth_display *d, uint32_t token_hi,
+		     uint32_t token_lo)
+{
+	struct wth_connection *conn;
+	struct wth_connection *side;
+	struct wthp_callback *cb;
+	HostConnector *c;
+
+	conn = wth_object_get_user_data((struct wth_object *)d);
+	wth_debug("wth_display.bulk_channel");
+
+	if (conn->bulk.conn)
+		return;
+
+	/* Data arguments keep going in-band if this fails. Connecting must
+	 * not block dispatching: the side channel connects while it is
+	 * flushed along with conn, and its requests wait until then. */
+	c = new_peer_connector(conn->fd);
+	if (c == NULL) {
+		wth_error("Cannot open the side channel: %m");
+		return;
+	}
+
+	side = connection_from_connector(c);
+	if (side == NULL) {
+		wth_error("Cannot open the side channel: %m");
+		return;
+	}
+
+	side->bulk.conn = conn;
+	side->bulk.is_side = true;
+	conn->bulk.conn = side;
+
+	wth_display_bind_bulk_channel(side->display, token_hi, token_lo);
+
+	/* A server that does not know the token answers with an error
+	 * instead, for example another server behind the same address.
+	 * Data only goes on the side channel once the answer is done. */
+	cb = wth_display_sync(side->display);
+	if (cb)
+		wthp_callback_set_listener(cb, &bulk_bound_listener, conn);
 }
 
 static const struct wth_display_listener display_listener = {
 	display_error,
 	display_delete_id,
-	display_server_version
+	display_server_version,
+	display_bulk_channel
 };
 
 /* END wthp_display client implementation */
 
 /* BEGIN wthp_display server implementation */
 
-/* TODO: these three declarations are copied from waltham-server.h, which can’t
+/* TODO: these declarations are copied from waltham-server.h, which can’t
  * be included together with waltham-client.h.  Find a way to make it possible
  * to include them both, or split this server implementation in another file.
  */
@@ -129,10 +363,22 @@ static const struct wth_display_listener display_listener = {
 void
 wthp_callback_send_done (struct wthp_callback * wthp_callback, uint32_t callback_data);
 
+void
+wth_display_send_server_version (struct wth_display * wth_display, uint32_t server_version);
+
+void
+wth_display_send_delete_id (struct wth_display * wth_display, uint32_t id);
+
+void
+wth_display_send_bulk_channel (struct wth_display * wth_display, uint32_t token_hi, uint32_t token_lo);
+
 struct wth_display_interface {
 	void (*client_version) (struct wth_display * wth_display, uint32_t client_version);
 	void (*sync) (struct wth_display * wth_display, struct wthp_callback * callback);
 	void (*get_registry) (struct wth_display * wth_display, struct wthp_registry * registry);
+	void (*open_bulk_channel) (struct wth_display * wth_display);
+	void (*bind_bulk_channel) (struct wth_display * wth_display, uint32_t token_hi, uint32_t token_lo);
+	void (*bulk_data) (struct wth_display * wth_display, uint32_t id, uint32_t data_sz, void * data);
 };
 
 static inline void
@@ -145,8 +391,11 @@ static void
 display_handle_client_version(struct wth_display *wth_display,
                               uint32_t client_version)
 {
-	wth_object_post_error((struct wth_object *)wth_display, 0,
-	                      "unimplemented: %s", __func__);
+	struct wth_object *disp_object = (struct wth_object *)wth_display;
+	struct wth_connection *conn = disp_object->connection;
+
+	wth_debug("Client announced wth_display version %d", client_version);
+	conn->peer_version = client_version;
 }
 
 static void
@@ -173,18 +422,168 @@ display_handle_get_registry(struct wth_display *wth_display,
 	conn->registry_callback(registry, conn->registry_callback_user_data);
 }
 
+/* Connections that offered a side channel not yet bound. A side
+ * channel is a connection of its own until it binds, which may be
+ * served by another thread than the one it binds to. */
+static pthread_mutex_t bulk_offers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct wth_connection *bulk_offers;
+
+/* Called with bulk_offers_lock held */
+static void
+bulk_offer_unlink(struct wth_connection *conn)
+{
+	struct wth_connection **c;
+
+	for (c = &bulk_offers; *c; c = &(*c)->bulk.next_offer) {
+		if (*c == conn) {
+			*c = conn->bulk.next_offer;
+			break;
+		}
+	}
+
+	conn->bulk.token = 0;
+	conn->bulk.next_offer = NULL;
+}
+
+static void
+bulk_offer_remove(struct wth_connection *conn)
+{
+	pthread_mutex_lock(&bulk_offers_lock);
+	if (conn->bulk.token)
+		bulk_offer_unlink(conn);
+	pthread_mutex_unlock(&bulk_offers_lock);
+}
+
+static void
+display_handle_open_bulk_channel(struct wth_display *wth_display)
+{
+	struct wth_object *disp_object = (struct wth_object *)wth_display;
+	struct wth_connection *conn = disp_object->connection;
+	uint64_t token = 0;
+
+	wth_debug("Client requested wth_display.open_bulk_channel");
+
+	if (conn->bulk.conn || conn->bulk.is_side) {
+		wth_object_post_error(disp_object, 1,
+				      "side channel already open");
+		return;
+	}
+
+	pthread_mutex_lock(&bulk_offers_lock);
+	if (conn->bulk.token == 0) {
+		while (token == 0) {
+			if (getrandom(&token, sizeof token, 0) !=
+			    sizeof token) {
+				pthread_mutex_unlock(&bulk_offers_lock);
+				wth_connection_post_error_no_memory(conn);
+				return;
+			}
+		}
+
+		conn->bulk.token = token;
+		conn->bulk.next_offer = bulk_offers;
+		bulk_offers = conn;
+	}
+	token = conn->bulk.token;
+	pthread_mutex_unlock(&bulk_offers_lock);
+
+	wth_display_send_bulk_channel(wth_display, token >> 32,
+				      token & 0xffffffff);
+}
+
+static void
+display_handle_bind_bulk_channel(struct wth_display *wth_display,
+				 uint32_t token_hi, uint32_t token_lo)
+{
+	struct wth_object *disp_object = (struct wth_object *)wth_display;
+	struct wth_connection *conn = disp_object->connection;
+	uint64_t token = (uint64_t) token_hi << 32 | token_lo;
+	struct wth_connection *owner;
+
+	pthread_mutex_lock(&bulk_offers_lock);
+	for (owner = bulk_offers; owner; owner = owner->bulk.next_offer)
+		if (owner->bulk.token == token)
+			break;
+
+	if (owner == NULL || owner == conn || conn->bulk.conn) {
+		pthread_mutex_unlock(&bulk_offers_lock);
+		wth_object_post_error(disp_object, 1,
+				      "unknown side channel token");
+		return;
+	}
+
+	/* From here on, dispatching one touches the other as well */
+	bulk_offer_unlink(owner);
+	owner->bulk.conn = conn;
+	conn->bulk.conn = owner;
+	conn->bulk.is_side = true;
+	pthread_mutex_unlock(&bulk_offers_lock);
+
+	wth_debug("Connection %p is the side channel of %p", conn, owner);
+}
+
+static void
+display_handle_bulk_data(struct wth_display *wth_display, uint32_t id,
+			 uint32_t data_sz, void *data)
+{
+	struct wth_object *disp_object = (struct wth_object *)wth_display;
+	struct wth_connection *conn = disp_object->connection;
+	struct wth_connection *owner = conn->bulk.conn;
+
+	if (!conn->bulk.is_side) {
+		wth_object_post_error(disp_object, 1,
+				      "not a side channel");
+		return;
+	}
+
+	/* The connection it was for is gone */
+	if (owner == NULL)
+		return;
+
+	if (reader_add_bulk_data(owner->reader, id, data, data_sz))
+		return;
+
+	/* The requests on the owner would wait for it forever */
+	wth_connection_set_error(owner, EPROTO);
+
+	if (errno == ENOMEM)
+		wth_connection_post_error_no_memory(conn);
+	else if (errno == ENOBUFS)
+		wth_object_post_error(disp_object, 1,
+				      "too much side channel data pending");
+	else
+		wth_object_post_error(disp_object, 1,
+				      "side channel data id %u out of order",
+				      id);
+}
+
 static const struct wth_display_interface display_implementation = {
 	display_handle_client_version,
 	display_handle_sync,
-	display_handle_get_registry
+	display_handle_get_registry,
+	display_handle_open_bulk_channel,
+	display_handle_bind_bulk_channel,
+	display_handle_bulk_data
 };
 
 /* END wthp_display server implementation */
 
+static void
+connection_release_objects(struct wth_connection *conn)
+{
+	void **chunk;
+
+	wth_array_for_each(chunk, &conn->objects.chunks)
+		free(*chunk);
+	wth_array_release(&conn->objects.chunks);
+}
+
 WTH_EXPORT struct wth_connection *
 wth_connection_from_fd(int fd, enum wth_connection_side side)
 {
 	struct wth_connection *conn;
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
 
 	conn = calloc(1, sizeof *conn);
 
@@ -193,8 +592,24 @@ wth_connection_from_fd(int fd, enum wth_connection_side side)
 
 	conn->fd = fd;
 	conn->side = side;
+	conn->pass_fds = getsockname(fd, (struct sockaddr *) &addr, &len) == 0 &&
+			 addr.ss_family == AF_UNIX;
 
 	conn->reader = new_reader();
+	conn->writer = new_writer();
+	conn->input_writer = new_writer();
+	if (conn->reader == NULL || conn->writer == NULL ||
+	    conn->input_writer == NULL) {
+		if (conn->reader)
+			free_reader(conn->reader);
+		if (conn->writer)
+			free_writer(conn->writer);
+		if (conn->input_writer)
+			free_writer(conn->input_writer);
+		free(conn);
+		return NULL;
+	}
+
 	wth_map_init(&conn->map, side);
 
 	/* id 0 should be NULL, id 1 the display */
@@ -210,10 +625,20 @@ wth_connection_from_fd(int fd, enum wth_connection_side side)
 	}
 
 	if (conn->display == NULL) {
+		wth_map_release(&conn->map);
+		connection_release_objects(conn);
+		free_reader(conn->reader);
+		free_writer(conn->writer);
+		free_writer(conn->input_writer);
 		free(conn);
-		conn = NULL;
+		return NULL;
 	}
 
+	/* Lets the client know which features it may use */
+	if (side == WTH_CONNECTION_SIDE_SERVER)
+		wth_display_send_server_version(conn->display,
+						WTH_DISPLAY_VERSION);
+
 	return conn;
 }
 
@@ -232,23 +657,80 @@ wth_connection_insert_new_object(struct wth_connection *conn,
 	wth_debug("%s: new object id: %d", __func__, obj->id);
 }
 
-void
+int
 wth_connection_insert_object_with_id(struct wth_connection *conn,
 		struct wth_object *obj)
 {
 	wth_debug("%s: %d", __func__, obj->id);
 
-	wth_map_reserve_new(&conn->map, obj->id);
-	wth_map_insert_at(&conn->map, 0, obj->id, obj);
+	/* Only IDs from the peer's range that are not in use */
+	if (wth_map_reserve_new(&conn->map, obj->id) < 0)
+		return -1;
+
+	return wth_map_insert_at(&conn->map, 0, obj->id, obj);
+}
+
+void
+wth_connection_reject_new_id(struct wth_connection *conn, uint32_t id)
+{
+	wth_debug("Cannot create object %u: %s", id, strerror(errno));
+
+	if (conn->side == WTH_CONNECTION_SIDE_CLIENT) {
+		wth_connection_set_protocol_error(conn, id, "wth_display", 0);
+		return;
+	}
+
+	if (errno == ENOMEM)
+		wth_connection_post_error_no_memory(conn);
+	else	/* wth_display.error.invalid_object */
+		wth_object_post_error((struct wth_object *) conn->display, 0,
+				      "invalid new object id %u", id);
+}
+
+void
+wth_connection_reject_message(struct wth_connection *conn,
+			      struct wth_object *obj, const char *name)
+{
+	wth_debug("No handler for %s on object %u", name, obj->id);
+
+	/* wth_display.error.invalid_method */
+	if (conn->side == WTH_CONNECTION_SIDE_CLIENT)
+		wth_connection_set_protocol_error(conn, obj->id, "unknown", 1);
+	else
+		wth_object_post_error(obj, 1, "%s is not implemented", name);
 }
 
 void
 wth_connection_remove_object(struct wth_connection *conn,
 		struct wth_object *obj)
 {
-	/* XXX use _remove when we are ready to reuse ids */
-	//wth_map_remove(&conn->map, obj->id);
+	/* A client ID is reused once the server has acknowledged its
+	 * deletion with wth_display.delete_id. Until then the entry stays
+	 * reserved, so that events still on their way find no object. */
+	if (conn->side == WTH_CONNECTION_SIDE_CLIENT &&
+	    obj->id < WTH_SERVER_ID_START && obj->id_deleted) {
+		wth_map_remove(&conn->map, obj->id);
+		return;
+	}
+
+	/* Like Wayland, the server reuses its own IDs as soon as it
+	 * destroys the object. Protocols destroy such objects with a
+	 * destructor request, so the client has let go of the ID first. */
+	if (conn->side == WTH_CONNECTION_SIDE_SERVER &&
+	    obj->id >= WTH_SERVER_ID_START) {
+		wth_map_remove(&conn->map, obj->id);
+		return;
+	}
+
 	wth_map_insert_at(&conn->map, 0, obj->id, NULL);
+
+	/* Nobody is listening once the connection goes */
+	if (conn->side == WTH_CONNECTION_SIDE_SERVER &&
+	    obj->id < WTH_SERVER_ID_START &&
+	    obj != (struct wth_object *) conn->display &&
+	    conn->peer_version >= 4 &&
+	    !conn->objects.tearing_down)
+		wth_display_send_delete_id(conn->display, obj->id);
 }
 
 struct wth_object *
@@ -258,91 +740,905 @@ wth_connection_get_object(struct wth_connection *conn, uint32_t id)
 }
 
 WTH_EXPORT void
-wth_connection_destroy(struct wth_connection *conn)
+wth_connection_set_object_user_size(struct wth_connection *conn, size_t size)
 {
-	close(conn->fd);
-
-	wth_object_delete((struct wth_object *) conn->display);
-	wth_map_release(&conn->map);
-	free_reader(conn->reader);
-
-	free(conn);
+	conn->objects.user_size = size;
 }
 
-WTH_EXPORT int
-wth_connection_flush(struct wth_connection *conn)
+size_t
+wth_connection_get_object_user_size(struct wth_connection *conn)
 {
-	/* FIXME currently we don't use the ringbuffer to send messages,
-	 * they are just written to the fd in write_all() in
-	 * src/marshaller/marshaller.h. */
+	return conn->objects.user_size;
+}
 
-	return 0;
+void
+wth_connection_use_destroy_hooks(struct wth_connection *conn)
+{
+	conn->objects.destroy_hooks = true;
 }
 
-WTH_EXPORT int
-wth_connection_read(struct wth_connection *conn)
+/* Carve a new chunk into free blocks of a size class */
+static bool
+connection_grow_slab(struct wth_connection *conn, unsigned class)
 {
-	/* If the connection is set to EPROTO, we still want to empty the kernel
-	 * buffers. We just discard the messages without dispatching them. */
-	if (conn->error && conn->error != EPROTO) {
-		errno = conn->error;
-		return -1;
+	size_t block = class * WTH_OBJECT_SLAB_STEP;
+	void **entry;
+	uint8_t *chunk;
+	size_t off;
+
+	entry = wth_array_add(&conn->objects.chunks, sizeof *entry);
+	if (entry == NULL)
+		return false;
+
+	chunk = malloc(WTH_OBJECT_SLAB_CHUNK);
+	if (chunk == NULL) {
+		conn->objects.chunks.size -= sizeof *entry;
+		return false;
 	}
+	*entry = chunk;
 
-	if (!reader_pull_new_messages(conn->reader, conn->fd, true)) {
-		/* Don't set the connection to error state in case of EAGAIN.
-		 * We still return -1, but the user should handle errno == EAGAIN. */
-		if (errno != EAGAIN)
-			wth_connection_set_error(conn, errno);
-
-		return -1;
+	for (off = 0; off + block <= WTH_OBJECT_SLAB_CHUNK; off += block) {
+		*(void **) (chunk + off) = conn->objects.free[class];
+		conn->objects.free[class] = chunk + off;
 	}
 
-	/* Discard read messages without dispatching them if the connection
-	 * was set to EPROTO. */
-	if (conn->error == EPROTO)
-		reader_flush(conn->reader);
-
-	return 0;
+	return true;
 }
 
-WTH_EXPORT int
-wth_connection_dispatch(struct wth_connection *conn)
+struct wth_object *
+wth_connection_alloc_object(struct wth_connection *conn, size_t size)
 {
-	int i, complete;
-
-	/* If there is an error, we still want to empty the ringbuffer.
-	 * Messages won't be dispatched though, so this should be safe. */
+	unsigned class;
+	struct wth_object *obj;
 
-	for (i = 0 ; i < conn->reader->m_complete; i++) {
-		msg_t msg;
+	class = (size + WTH_OBJECT_SLAB_STEP - 1) / WTH_OBJECT_SLAB_STEP;
+	if (class > WTH_OBJECT_SLAB_CLASSES)
+		return calloc(1, size);
 
-		reader_map_message(conn->reader, i, &msg);
-		wth_debug("Message received on conn %p: (%d) %d bytes",
-			  conn, msg.hdr->opcode, msg.hdr->sz);
+	if (conn->objects.free[class] == NULL &&
+	    !connection_grow_slab(conn, class))
+		return NULL;
 
-		/* Don't dispatch more messages after the connection is set
-		 * to EPROTO. */
-		if (conn->error != EPROTO)
-			msg_dispatch(conn, &msg);
+	obj = conn->objects.free[class];
+	conn->objects.free[class] = *(void **) obj;
 
-		reader_unmap_message(conn->reader, i, &msg);
-	}
+	memset(obj, 0, class * WTH_OBJECT_SLAB_STEP);
+	obj->slab_class = class;
 
-	complete = conn->reader->m_complete;
+	return obj;
+}
 
-	/* Remove processed messages */
-	reader_flush(conn->reader);
+void
+wth_connection_free_object(struct wth_connection *conn,
+			   struct wth_object *obj)
+{
+	unsigned class = obj->slab_class;
 
-	/* The connection has been set to error in this call. */
-	if (conn->error) {
-		errno = conn->error;
-		return -1;
+	if (class == 0) {
+		free(obj);
+		return;
+	}
+
+	*(void **) obj = conn->objects.free[class];
+	conn->objects.free[class] = obj;
+}
+
+static void
+connection_unbind_bulk(struct wth_connection *conn)
+{
+	struct wth_connection *other = conn->bulk.conn;
+
+	if (conn->side == WTH_CONNECTION_SIDE_SERVER)
+		bulk_offer_remove(conn);
+
+	if (other == NULL)
+		return;
+
+	other->bulk.conn = NULL;
+	conn->bulk.conn = NULL;
+	conn->bulk.bound = false;
+
+	/* The client opened the side channel for this connection */
+	if (conn->side == WTH_CONNECTION_SIDE_CLIENT && !conn->bulk.is_side)
+		wth_connection_destroy(other);
+}
+
+static enum wth_iterator_result
+connection_destroy_object(void *element, void *data)
+{
+	struct wth_object *obj = element;
+
+	if (obj->destroy_hook)
+		obj->destroy_hook(obj);
+
+	return WTH_ITERATOR_CONTINUE;
+}
+
+/* Zero-copy buffers are released along with the writer. If the kernel
+ * still holds some, a plain close would go on sending them after the
+ * caller got them back; resetting the connection drops them instead. */
+static void
+connection_close(struct wth_connection *conn)
+{
+	struct linger reset = { 1, 0 };
+
+	writer_reap_completions(conn->writer, conn->fd);
+	if (writer_zerocopy_pending(conn->writer) &&
+	    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER,
+		       &reset, sizeof reset) < 0)
+		wth_error("Zero-copy buffers may still be sent: %m");
+
+	close(conn->fd);
+}
+
+WTH_EXPORT void
+wth_connection_destroy(struct wth_connection *conn)
+{
+	/* One pass over the map instead of lists kept by the user. Hooks
+	 * only remove entries, which the walk skips. */
+	conn->objects.tearing_down = true;
+	if (conn->objects.destroy_hooks)
+		wth_map_for_each(&conn->map, connection_destroy_object, NULL);
+
+	connection_unbind_bulk(conn);
+
+	if (conn->connector)
+		free_connector(conn->connector);
+	else
+		connection_close(conn);
+
+	wth_object_delete((struct wth_object *) conn->display);
+	wth_map_release(&conn->map);
+	connection_release_objects(conn);
+	free_reader(conn->reader);
+	free_writer(conn->writer);
+	free_writer(conn->input_writer);
+	free(conn->bulk.descs);
+
+	free(conn);
+}
+
+/* Whether this end opened the side channel of the connection */
+static bool
+connection_owns_bulk(struct wth_connection *conn)
+{
+	return conn->side == WTH_CONNECTION_SIDE_CLIENT &&
+	       conn->bulk.conn && !conn->bulk.is_side;
+}
+
+/* The client reads the side channel along with conn, for the answer to
+ * binding it and for errors. Until the server has accepted it, losing
+ * it only keeps data in-band. After that, requests already sent on conn
+ * may wait for data that never arrives, so its error is conn's. */
+static void
+connection_check_bulk(struct wth_connection *conn)
+{
+	struct wth_connection *side = conn->bulk.conn;
+
+	if (!connection_owns_bulk(conn) || side->error == 0)
+		return;
+
+	if (!conn->bulk.bound) {
+		wth_error("Cannot open the side channel: %s",
+			  strerror(side->error));
+		connection_unbind_bulk(conn);
+		return;
+	}
+
+	if (side->error == EPROTO)
+		wth_connection_set_protocol_error(conn,
+						  side->protocol_error.id,
+						  side->protocol_error.interface,
+						  side->protocol_error.code);
+	else
+		wth_connection_set_error(conn, side->error);
+}
+
+static size_t
+connection_queued(struct wth_connection *conn)
+{
+	return writer_queued(conn->writer) + writer_queued(conn->input_writer);
+}
+
+static void
+check_watermarks(struct wth_connection *conn)
+{
+	size_t queued = connection_queued(conn);
+
+	if (conn->watermark.high == 0)
+		return;
+
+	if (!conn->watermark.congested && queued >= conn->watermark.high) {
+		conn->watermark.congested = true;
+		if (conn->watermark.callback)
+			conn->watermark.callback(conn,
+						 WTH_CONNECTION_WATERMARK_HIGH,
+						 conn->watermark.user_data);
+	} else if (conn->watermark.congested &&
+		   queued <= conn->watermark.low) {
+		conn->watermark.congested = false;
+		if (conn->watermark.callback)
+			conn->watermark.callback(conn,
+						 WTH_CONNECTION_WATERMARK_LOW,
+						 conn->watermark.user_data);
+	}
+}
+
+static ssize_t
+connection_send(struct wth_connection *conn)
+{
+	ClientWriter *writer = conn->writer;
+	ssize_t total = 0;
+	ssize_t ret;
+
+	do {
+		/* Input messages go first, but never in the middle of a
+		 * message or frame from the other queue. */
+		if (writer->total_written >= writer->unit_end) {
+			ret = writer_flush(conn->input_writer, conn->fd);
+			if (ret < 0)
+				goto fail;
+			total += ret;
+
+			writer_next_unit(writer);
+		}
+
+		ret = writer_flush_unit(writer, conn->fd);
+		if (ret < 0)
+			goto fail;
+		total += ret;
+	} while (writer_queued(writer) > 0);
+
+	return total;
+
+fail:
+	if (errno != EAGAIN)
+		wth_connection_set_error(conn, errno);
+
+	return -1;
+}
+
+static ClientWriter *
+connection_writer(struct wth_connection *conn,
+		  enum message_priority priority, size_t total_size)
+{
+	/* Fragmented input messages would interleave with the frames of
+	 * another message, which the peer cannot reassemble. */
+	if (priority == MESSAGE_PRIORITY_INPUT && total_size <= 0xffff)
+		return conn->input_writer;
+
+	return conn->writer;
+}
+
+uint8_t *
+wth_connection_reserve_message(struct wth_connection *conn, size_t size,
+			       size_t total_size,
+			       enum message_priority priority)
+{
+	ClientWriter *writer = connection_writer(conn, priority, total_size);
+	uint8_t *p;
+
+	/* Messages are still sent after a protocol error, so that the
+	 * error event reaches the client. */
+	if (conn->error && conn->error != EPROTO) {
+		errno = conn->error;
+		return NULL;
+	}
+
+	/* The peer would refuse to reassemble it */
+	if (total_size > sizeof(hdr_t) + MESSAGE_MAX_REASSEMBLED_SIZE) {
+		wth_error("Message of %zu bytes is too large", total_size);
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	/* Rather than growing the send buffer, first try to make room by
+	 * sending what is already queued. A corked connection keeps
+	 * collecting instead. */
+	if (!conn->cork && !writer_has_space(writer, size) &&
+	    connection_send(conn) < 0 && errno != EAGAIN)
+		return NULL;
+
+	p = writer_reserve(writer, size);
+	if (p == NULL) {
+		wth_connection_set_error(conn, ENOMEM);
+		errno = ENOMEM;
+	}
+
+	conn->bulk.d_count = 0;
+	conn->bulk.external = 0;
+	conn->bulk.diverted = 0;
+
+	return p;
+}
+
+static bool
+connection_use_compression(struct wth_connection *conn, size_t size)
+{
+	return conn->compression.threshold > 0 &&
+	       size >= conn->compression.threshold &&
+	       conn->peer_version >= 2;
+}
+
+/* Put the list of data arguments sent on the side channel in front of
+ * the body of the reserved message */
+static bool
+connection_commit_bulk(struct wth_connection *conn, size_t *size,
+		       size_t *total_size)
+{
+	size_t plen = sizeof(uint32_t) * (1 + 3 * conn->bulk.d_count);
+	uint8_t *msg;
+	hdr_t hdr;
+
+	conn->bulk.descs[0] = conn->bulk.d_count;
+	msg = writer_insert_prefix(conn->writer, size, conn->bulk.descs, plen);
+	if (msg == NULL)
+		return false;
+
+	*total_size = *total_size - conn->bulk.diverted + plen;
+
+	memcpy(&hdr, msg, sizeof hdr);
+	hdr.flags |= M_FLAG_BULK;
+	hdr.sz = *total_size;
+	memcpy(msg, &hdr, sizeof hdr);
+
+	return true;
+}
+
+void
+wth_connection_commit_message(struct wth_connection *conn, size_t size,
+			      size_t total_size,
+			      enum message_priority priority)
+{
+	ClientWriter *writer = connection_writer(conn, priority, total_size);
+	size_t payload_max = 0;
+
+	/* What stays is small enough to neither compress nor frame */
+	if (writer == conn->writer && conn->bulk.d_count > 0) {
+		if (!connection_commit_bulk(conn, &size, &total_size)) {
+			wth_connection_set_error(conn, ENOMEM);
+			return;
+		}
+	} else if (writer == conn->writer &&
+		   connection_use_compression(conn, total_size) &&
+		   !writer_compress(writer, &size, &total_size)) {
+		/* The input queue only holds small messages */
+		wth_connection_set_error(conn, ENOMEM);
+		return;
+	}
+
+	/* Too large for the 16-bit size field, or bulk data that should
+	 * not hold up input for long: send it in frames. */
+	if (total_size > 0xffff)
+		payload_max = FRAGMENT_PAYLOAD_MAX;
+	if (priority == MESSAGE_PRIORITY_BULK &&
+	    total_size > sizeof(hdr_t) + BULK_SLICE_SIZE)
+		payload_max = BULK_SLICE_SIZE;
+
+	if (payload_max == 0)
+		writer_commit(writer, size);
+	else if (!writer_commit_fragmented(writer, size, total_size,
+					   payload_max))
+		wth_connection_set_error(conn, ENOMEM);
+
+	check_watermarks(conn);
+}
+
+void
+wth_connection_commit_coalescible(struct wth_connection *conn, size_t size,
+				  size_t total_size,
+				  enum message_priority priority,
+				  uint32_t key)
+{
+	ClientWriter *writer = connection_writer(conn, priority, total_size);
+
+	/* Only the input queue coalesces, and never fragmented messages */
+	if (writer != conn->input_writer) {
+		wth_connection_commit_message(conn, size, total_size, priority);
+		return;
+	}
+
+	writer_commit_coalescible(writer, size, key);
+
+	check_watermarks(conn);
+}
+
+static bool
+connection_use_zerocopy(struct wth_connection *conn, size_t size)
+{
+	return conn->zerocopy.threshold > 0 &&
+	       size >= conn->zerocopy.threshold;
+}
+
+static bool
+connection_use_bulk(struct wth_connection *conn, size_t size)
+{
+	return conn->side == WTH_CONNECTION_SIDE_CLIENT &&
+	       conn->bulk.conn && !conn->bulk.is_side && conn->bulk.bound &&
+	       conn->bulk.threshold > 0 && size >= conn->bulk.threshold;
+}
+
+size_t
+wth_connection_external_size(struct wth_connection *conn, size_t size)
+{
+	/* Data that will be split over frames anyway is kept out of the
+	 * output buffer, so that framing does not copy it around. */
+	if (connection_use_zerocopy(conn, size) ||
+	    connection_use_bulk(conn, size) ||
+	    size >= FRAGMENT_PAYLOAD_MAX)
+		return size;
+
+	return 0;
+}
+
+/* Send a data argument of the reserved message on the side channel,
+ * unless the rest of the message would still need frames. */
+static bool
+connection_send_bulk(struct wth_connection *conn, size_t total_size,
+		     size_t offset, const void *data, size_t size)
+{
+	struct wth_connection *side = conn->bulk.conn;
+	size_t plen = sizeof(uint32_t) * (1 + 3 * (conn->bulk.d_count + 1));
+	uint32_t *desc;
+	uint32_t id;
+
+	if (side->error ||
+	    total_size - conn->bulk.diverted - PADDED(size) + plen >
+	    sizeof(hdr_t) + BULK_SLICE_SIZE)
+		return false;
+
+	if (1 + 3 * (conn->bulk.d_count + 1) > conn->bulk.d_total) {
+		int total = conn->bulk.d_total ? conn->bulk.d_total * 2 : 16;
+
+		desc = realloc(conn->bulk.descs, total * sizeof *desc);
+		if (desc == NULL)
+			return false;
+
+		conn->bulk.descs = desc;
+		conn->bulk.d_total = total;
+	}
+
+	id = ++conn->bulk.next_id;
+	wth_display_bulk_data(side->display, id, size, (void *) data);
+	if (side->error)
+		return false;
+
+	desc = conn->bulk.descs + 1 + 3 * conn->bulk.d_count++;
+	desc[0] = id;
+	desc[1] = offset - sizeof(hdr_t) + conn->bulk.external;
+	desc[2] = size;
+
+	/* The padding goes too, keeping the message a multiple of 4 bytes
+	 * long like all others */
+	conn->bulk.diverted += PADDED(size);
+
+	return true;
+}
+
+bool
+wth_connection_add_external(struct wth_connection *conn,
+			    enum message_priority priority, size_t total_size,
+			    size_t offset, const void *data, size_t size)
+{
+	ClientWriter *writer = connection_writer(conn, priority, total_size);
+	bool ret;
+
+	/* Messages in the input queue are sent as they are */
+	if (writer == conn->writer && connection_use_bulk(conn, size) &&
+	    connection_send_bulk(conn, total_size, offset, data, size)) {
+		conn->bulk.external += PADDED(size);
+		return true;
+	}
+
+	/* Zero-copy completions are numbered per socket, so only one
+	 * writer may use it. */
+	if (writer == conn->writer && connection_use_zerocopy(conn, size))
+		ret = writer_add_reference(writer, offset, data, size);
+	else
+		ret = writer_add_copy(writer, offset, data, size);
+
+	conn->bulk.external += size;
+
+	if (!ret)
+		wth_connection_set_error(conn, ENOMEM);
+
+	return false;
+}
+
+void
+wth_connection_add_fd(struct wth_connection *conn,
+		      enum message_priority priority, size_t total_size,
+		      int fd)
+{
+	ClientWriter *writer = connection_writer(conn, priority, total_size);
+	int dup_fd;
+
+	if (!conn->pass_fds) {
+		wth_error("File descriptors can only be sent over AF_UNIX "
+			  "sockets");
+		wth_connection_set_error(conn, EINVAL);
+		return;
+	}
+
+	/* The caller keeps its fd */
+	dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd < 0) {
+		wth_connection_set_error(conn, errno);
+		return;
+	}
+
+	if (!writer_add_fd(writer, dup_fd)) {
+		close(dup_fd);
+		wth_connection_set_error(conn, ENOMEM);
+	}
+}
+
+int
+wth_connection_take_fd(struct wth_connection *conn)
+{
+	int fd = reader_take_fd(conn->reader);
+
+	if (fd < 0) {
+		wth_error("Message without the file descriptor it carries");
+		wth_connection_set_error(conn, EPROTO);
+	}
+
+	return fd;
+}
+
+WTH_EXPORT int
+wth_connection_can_pass_fds(struct wth_connection *conn)
+{
+	return conn->pass_fds;
+}
+
+static void
+connection_zerocopy_release(const void *data, void *user_data)
+{
+	struct wth_connection *conn = user_data;
+
+	conn->zerocopy.release(conn, data, conn->zerocopy.user_data);
+}
+
+WTH_EXPORT int
+wth_connection_set_zerocopy(struct wth_connection *conn, size_t threshold,
+			    wth_zerocopy_release_func release,
+			    void *user_data)
+{
+#ifdef SO_ZEROCOPY
+	int flag = threshold > 0;
+
+	if (conn->connector) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (threshold > 0 && release == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY,
+		       &flag, sizeof flag) < 0)
+		return -1;
+
+	conn->zerocopy.threshold = threshold;
+	conn->writer->zerocopy = flag;
+
+	/* Buffers still in flight are released through the old callback
+	 * when disabling. */
+	if (flag) {
+		conn->zerocopy.release = release;
+		conn->zerocopy.user_data = user_data;
+		conn->writer->release = connection_zerocopy_release;
+		conn->writer->release_data = conn;
+	}
+
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+WTH_EXPORT int
+wth_connection_flush(struct wth_connection *conn)
+{
+	bool side_again;
+	ssize_t ret;
+
+	if (conn->error && conn->error != EPROTO) {
+		errno = conn->error;
+		return -1;
+	}
+
+	/* Messages stay queued until connected */
+	if (conn->connector && connection_continue_connect(conn) < 0) {
+		if (errno == EINPROGRESS)
+			errno = EAGAIN;
+		return -1;
+	}
+
+	writer_reap_completions(conn->writer, conn->fd);
+
+	ret = connection_send(conn);
+
+	check_watermarks(conn);
+
+	/* The data the sent messages refer to */
+	if (connection_owns_bulk(conn)) {
+		side_again = wth_connection_flush(conn->bulk.conn) < 0 &&
+			     errno == EAGAIN;
+		connection_check_bulk(conn);
+
+		if (conn->error && conn->error != EPROTO) {
+			errno = conn->error;
+			return -1;
+		}
+
+		/* Until it is bound, nothing waits for the side channel */
+		if (side_again && conn->bulk.bound) {
+			errno = EAGAIN;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+WTH_EXPORT void
+wth_connection_cork(struct wth_connection *conn)
+{
+	conn->cork++;
+}
+
+WTH_EXPORT int
+wth_connection_uncork(struct wth_connection *conn)
+{
+	if (conn->cork == 0) {
+		wth_error("%s: connection %p is not corked", __func__, conn);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (--conn->cork > 0)
+		return 0;
+
+	return wth_connection_flush(conn);
+}
+
+WTH_EXPORT void
+wth_connection_set_compression(struct wth_connection *conn, size_t threshold)
+{
+	conn->compression.threshold = threshold;
+}
+
+WTH_EXPORT int
+wth_connection_open_bulk_channel(struct wth_connection *conn,
+				 size_t threshold)
+{
+	ASSERT_CLIENT_SIDE(conn);
+
+	if (conn->peer_version < 3) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (conn->bulk.is_side || threshold == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (conn->bulk.threshold == 0)
+		wth_display_open_bulk_channel(conn->display);
+
+	conn->bulk.threshold = threshold;
+
+	return 0;
+}
+
+WTH_EXPORT int
+wth_connection_get_bulk_fd(struct wth_connection *conn)
+{
+	if (!connection_owns_bulk(conn))
+		return -1;
+
+	return conn->bulk.conn->fd;
+}
+
+WTH_EXPORT void
+wth_connection_set_coalescing(struct wth_connection *conn, int enabled)
+{
+	writer_set_coalesce(conn->input_writer, enabled);
+}
+
+WTH_EXPORT size_t
+wth_connection_get_queued_bytes(struct wth_connection *conn)
+{
+	return connection_queued(conn);
+}
+
+WTH_EXPORT void
+wth_connection_set_watermarks(struct wth_connection *conn,
+			      size_t low, size_t high)
+{
+	conn->watermark.low = low;
+	conn->watermark.high = high;
+	if (high == 0)
+		conn->watermark.congested = false;
+
+	check_watermarks(conn);
+}
+
+WTH_EXPORT void
+wth_connection_set_watermark_callback(struct wth_connection *conn,
+				      wth_watermark_callback_func callback,
+				      void *user_data)
+{
+	conn->watermark.callback = callback;
+	conn->watermark.user_data = user_data;
+}
+
+WTH_EXPORT void
+wth_connection_set_read_budget(struct wth_connection *conn,
+			       size_t max_bytes, int max_messages)
+{
+	conn->read_budget.bytes = max_bytes;
+	conn->read_budget.messages = max_messages > 0 ? max_messages : 0;
+}
+
+WTH_EXPORT void
+wth_connection_set_receive_buffer(struct wth_connection *conn,
+				  size_t min_size, size_t max_size)
+{
+	reader_set_ring_limits(conn->reader, min_size, max_size);
+}
+
+WTH_EXPORT int
+wth_connection_read(struct wth_connection *conn)
+{
+	int ret;
+
+	/* If the connection is set to EPROTO, we still want to empty the kernel
+	 * buffers. We just discard the messages without dispatching them. */
+	if (conn->error && conn->error != EPROTO) {
+		errno = conn->error;
+		return -1;
+	}
+
+	/* Nothing can have arrived on a connection that just formed */
+	if (conn->connector) {
+		if (connection_continue_connect(conn) == 0)
+			return 0;
+		if (errno == EINPROGRESS)
+			errno = EAGAIN;
+		return -1;
+	}
+
+	ret = reader_pull_new_messages(conn->reader, conn->fd,
+				       conn->read_budget.bytes,
+				       conn->read_budget.messages);
+	if (ret < 0) {
+		/* What was read before the error can still be dispatched */
+		wth_connection_set_error(conn, errno);
+		return -1;
+	}
+
+	/* Whatever the side channel has to say */
+	if (connection_owns_bulk(conn)) {
+		if (wth_connection_read(conn->bulk.conn) < 0 && errno != EAGAIN)
+			wth_debug("Side channel read failed: %m");
+		connection_check_bulk(conn);
+	}
+
+	/* Discard read messages without dispatching them if the connection
+	 * was set to EPROTO. */
+	if (conn->error == EPROTO) {
+		reader_parse_messages(conn->reader, 0);
+		reader_flush(conn->reader);
+	}
+
+	return ret;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Dispatch from the oldest buffered message on, stopping after
+ * max_messages or once max_ns have passed, when not 0. At least one
+ * message is dispatched, so that every call makes progress. */
+static int
+connection_dispatch_messages(struct wth_connection *conn, int max_messages,
+			     uint64_t max_ns)
+{
+	ClientReader *reader = conn->reader;
+	uint64_t deadline = 0;
+	int ret, count = 0;
+	msg_t msg;
+
+	if (max_ns)
+		deadline = monotonic_ns() + max_ns;
+
+	/* If there is an error, we still want to empty the ringbuffer.
+	 * Messages won't be dispatched though, so this should be safe. */
+
+	while ((ret = reader_next_message(reader, &msg)) > 0) {
+		wth_trace("Message received on conn %p: (%d) %zu bytes",
+			  conn, msg.hdr->opcode, msg.length);
+
+		/* Don't dispatch more messages after the connection is set
+		 * to EPROTO. */
+		if (conn->error != EPROTO)
+			msg_dispatch(conn, &msg);
+		count++;
+
+		if (conn->error == EPROTO)
+			continue;
+		if ((max_messages > 0 && count >= max_messages) ||
+		    (deadline && monotonic_ns() >= deadline))
+			break;
+	}
+	if (ret < 0)
+		wth_connection_set_error(conn, errno);
+
+	/* Remove processed messages */
+	reader_release_messages(reader);
+
+	/* Messages waiting for the data that came in may go on */
+	if (conn->bulk.is_side && conn->bulk.conn &&
+	    conn->side == WTH_CONNECTION_SIDE_SERVER)
+		wth_connection_dispatch(conn->bulk.conn);
+
+	/* The client's side channel only carries answers and errors */
+	if (connection_owns_bulk(conn)) {
+		connection_dispatch_messages(conn->bulk.conn, 0, 0);
+		connection_check_bulk(conn);
+	}
+
+	return count;
+}
+
+WTH_EXPORT int
+wth_connection_dispatch(struct wth_connection *conn)
+{
+	int complete;
+
+	complete = connection_dispatch_messages(conn, 0, 0);
+
+	/* The connection has been set to error in this call. */
+	if (conn->error) {
+		errno = conn->error;
+		return -1;
 	}
 
 	return complete;
 }
 
+WTH_EXPORT int
+wth_connection_dispatch_budget(struct wth_connection *conn,
+			       int max_messages, uint64_t max_ns)
+{
+	connection_dispatch_messages(conn, max_messages, max_ns);
+
+	/* Count what is left by parsing it ahead */
+	if (!conn->error && !reader_parse_messages(conn->reader, 0))
+		wth_connection_set_error(conn, errno);
+
+	if (conn->error) {
+		errno = conn->error;
+		return -1;
+	}
+
+	return conn->reader->m_complete;
+}
+
 static void
 sync_listener_handle_done(struct wthp_callback *cb, uint32_t arg)
 {
@@ -368,10 +1664,12 @@ wth_connection_roundtrip(struct wth_connection *conn)
 	cb = wth_display_sync(conn->display);
 	wthp_callback_set_listener(cb, &sync_listener, &flag);
 
-	pfd.fd = conn->fd;
 	pfd.events = POLLIN;
 
 	while (!flag) {
+		/* Changes once an asynchronous connection has formed */
+		pfd.fd = conn->fd;
+
 		/* Do not ignore EPROTO */
 		if (wth_connection_dispatch(conn) < 0)
 			break;
@@ -415,7 +1713,7 @@ wth_connection_roundtrip(struct wth_connection *conn)
 
 		if (pfd.revents & POLLIN) {
 			ret = wth_connection_read(conn);
-			if (ret < 0) {
+			if (ret < 0 && errno != EAGAIN) {
 				wth_debug("Roundtrip connection read error: %s",
 					  strerror(errno));
 				break;
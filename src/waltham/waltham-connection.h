@@ -97,10 +97,8 @@ struct wth_connection;
  *
  * On failure, errno is set.
  *
- * XXX: This call may block.
- * We should find a way to make this a non-blocking operation, so that
- * if the connection fails to form, we get an error back from read
- * and flush etc.
+ * This call blocks until the connection is formed or has failed, see
+ * wth_connect_to_server_async() for a non-blocking alternative.
  *
  * \memberof wth_connection
  * \client_api
@@ -108,6 +106,73 @@ struct wth_connection;
 struct wth_connection *
 wth_connect_to_server(const char *host, const char *port);
 
+/** Start connecting to a remote Waltham server
+ *
+ * \param host The address of the server.
+ * \param port The port of the server.
+ * \return A new connection, or NULL on failure.
+ *
+ * This creates a client-side wth_connection in connecting state and
+ * returns without waiting for the connection to form. When the host
+ * has several addresses, they are tried in parallel, alternating
+ * address families, with the next attempt started when the previous
+ * one has not succeeded within 250 ms. The first connection formed
+ * wins.
+ *
+ * While connecting, the fd from wth_connection_get_fd() becomes
+ * readable whenever wth_connection_finish_connect() needs to be
+ * called. wth_connection_read() and wth_connection_flush() call it
+ * too, and fail with EAGAIN until connected. Requests can be sent
+ * right away, they are queued until the connection has formed.
+ *
+ * Once connected, wth_connection_get_fd() returns the socket instead,
+ * which the caller must poll from then on.
+ *
+ * Resolving the host name still blocks, use a numeric address to
+ * avoid that.
+ *
+ * On failure, errno is set.
+ *
+ * \memberof wth_connection
+ * \client_api
+ */
+struct wth_connection *
+wth_connect_to_server_async(const char *host, const char *port);
+
+/** Continue forming a connection
+ *
+ * \param conn The Waltham connection.
+ * \return 0 once connected, -1 otherwise.
+ *
+ * Advances a connection created with wth_connect_to_server_async().
+ * Returns -1 with errno set to EINPROGRESS while still connecting.
+ * Any other errno means all attempts failed, and the connection is
+ * set to that error.
+ *
+ * Returns 0 right away for a connection that is already established.
+ *
+ * \memberof wth_connection
+ * \client_api
+ */
+int
+wth_connection_finish_connect(struct wth_connection *conn);
+
+/** Connect to a Waltham server on the same host
+ *
+ * \param name The name of the server socket in the abstract AF_UNIX
+ * namespace, without the leading null byte.
+ * \return A new connection, or NULL on failure.
+ *
+ * This creates a client-side wth_connection like
+ * wth_connect_to_server(), but over an AF_UNIX socket, over which
+ * file descriptors can be passed, see wth_connection_can_pass_fds().
+ *
+ * \memberof wth_connection
+ * \client_api
+ */
+struct wth_connection *
+wth_connect_to_unix_socket(const char *name);
+
 /** Accept a Waltham client connection
  *
  * \param sockfd A listening socket file descriptor to extract a
@@ -157,6 +222,23 @@ enum wth_connection_side {
 struct wth_connection *
 wth_connection_from_fd(int fd, enum wth_connection_side side);
 
+/** Check whether file descriptors can be passed
+ *
+ * \param conn The Waltham connection.
+ * \return 1 if the connection is over an AF_UNIX socket, 0 otherwise.
+ *
+ * Protocol messages with fd arguments, e.g.
+ * wthp_shm_factory.create_pool, can only be sent over connections for
+ * which this returns 1. Sending them over other connections sets the
+ * connection to EINVAL. A server should only advertise
+ * wthp_shm_factory to such clients.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+int
+wth_connection_can_pass_fds(struct wth_connection *conn);
+
 /** Get connection file descriptor
  *
  * \param conn The Waltham connection.
@@ -168,6 +250,9 @@ wth_connection_from_fd(int fd, enum wth_connection_side side);
  *
  * The fd will remain owned by the wth_connection.
  *
+ * The fd changes once a connection from wth_connect_to_server_async()
+ * has formed.
+ *
  * \memberof wth_connection
  * \common_api
  */
@@ -189,6 +274,25 @@ wth_connection_get_fd(struct wth_connection *conn);
 void
 wth_connection_destroy(struct wth_connection *conn);
 
+/** Allocate user state with every protocol object
+ *
+ * \param conn The Waltham connection.
+ * \param size Bytes of user state per object, or 0 for none.
+ *
+ * Protocol objects created on this connection from now on, by either
+ * side, carry size bytes of zeroed user state in the same allocation,
+ * see wth_object_get_user_state(). This saves a separate allocation for
+ * the state an application keeps per object.
+ *
+ * Objects and their state are allocated from blocks kept by the
+ * connection, so all objects must be destroyed before the connection.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_object_user_size(struct wth_connection *conn, size_t size);
+
 /** Flush buffered messages to the network
  *
  * \param conn The Waltham connection.
@@ -206,24 +310,326 @@ wth_connection_destroy(struct wth_connection *conn);
  * continue flushing events out so that the protocol error event will
  * reach the client.
  *
+ * A failure to write, e.g. because the remote disconnected, sets the
+ * connection into error state. Messages sent after that are dropped.
+ *
+ * Input events, e.g. wthp_pointer.motion, are sent ahead of other
+ * buffered messages. Bulk data, e.g. wthp_blob_factory.create_buffer,
+ * is sent in slices so that input does not wait for all of it.
+ *
  * \memberof wth_connection
  * \common_api
  */
 int
 wth_connection_flush(struct wth_connection *conn);
 
-/** Read data received from the network
+/** Start collecting outgoing messages into one batch
+ *
+ * \param conn The Waltham connection.
+ *
+ * While a connection is corked, sent messages are only appended to the
+ * output buffer and are never written to the network implicitly, not
+ * even when the buffer fills up. wth_connection_uncork() then sends the
+ * whole batch with as few syscalls as the socket allows.
+ *
+ * A typical use is a surface update: attach, damage, frame and commit
+ * are sent together in one write instead of trickling out.
+ *
+ * Calls nest; the batch is sent when the last wth_connection_uncork()
+ * is called. An explicit wth_connection_flush() still flushes.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_cork(struct wth_connection *conn);
+
+/** Send the messages collected since wth_connection_cork()
+ *
+ * \param conn The Waltham connection.
+ * \return The number of bytes written to network, or -1 on failure.
+ *
+ * Ends a wth_connection_cork() section. When the outermost section
+ * ends, this flushes as wth_connection_flush() does and returns the
+ * same values, including -1 with errno EAGAIN if the socket is full.
+ * Inner sections return 0 without sending.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+int
+wth_connection_uncork(struct wth_connection *conn);
+
+/** Get the amount of buffered outgoing data
  *
  * \param conn The Waltham connection.
+ * \return The number of bytes queued for sending.
+ *
+ * Sending a message never blocks and never fails for a full socket,
+ * the message is buffered instead. This returns how much data is
+ * waiting for wth_connection_flush().
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+size_t
+wth_connection_get_queued_bytes(struct wth_connection *conn);
+
+/** Coalesce superseded input events in the output buffer
+ *
+ * \param conn The Waltham connection.
+ * \param enabled Non-zero to enable, zero to disable.
+ *
+ * When the remote does not keep up, pointer and touch motion events
+ * pile up in the output buffer although only the latest position
+ * matters. With coalescing enabled, such an event replaces a buffered
+ * one for the same object that has not started sending yet, unless
+ * another event for the object, e.g. a button press, is in between.
+ * Touch points are coalesced separately. Frame events are coalesced
+ * the same way.
+ *
+ * The state the remote ends up with is unchanged, it only skips
+ * intermediate positions. Coalescing is disabled by default.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_coalescing(struct wth_connection *conn, int enabled);
+
+/** Compress large messages
+ *
+ * \param conn The Waltham connection.
+ * \param threshold Size in bytes from which messages are compressed,
+ * or 0 to disable compression.
+ *
+ * Messages of at least threshold bytes, in practice those carrying
+ * data or array arguments, are compressed with a fast LZ4-style codec
+ * before they are queued. Messages that would not get smaller are sent
+ * as they are.
+ *
+ * Compression only starts once the remote has announced that it can
+ * decompress, through wth_display version 2. Remotes of older versions
+ * keep receiving uncompressed messages. Received messages are always
+ * decompressed before dispatch when needed, whatever this setting.
+ *
+ * Compressed data arguments are copied, so a zero-copy release
+ * callback runs right after the message is queued.
+ *
+ * Compression is disabled by default.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_compression(struct wth_connection *conn, size_t threshold);
+
+/** Send large data arguments on a side channel
+ *
+ * \param conn The client-side Waltham connection.
+ * \param threshold Size in bytes from which data arguments of requests
+ * go on the side channel.
+ * \return 0 on success, -1 on failure with errno set: ENOTSUP if the
+ * server does not implement wth_display version 3, which is known after
+ * the first roundtrip.
+ *
+ * Asks the server for a side channel, a second connection to the same
+ * server address that only carries data arguments. Once the server has
+ * accepted the side channel, requests with data arguments of at least
+ * threshold bytes send that data on it, so that their bytes do not
+ * queue in front of later requests. Until then, or if opening the side
+ * channel fails, the data stays in-band.
+ *
+ * The server processes requests in the order they were sent: one whose
+ * data is still in transit holds up the requests after it. The side
+ * channel connects, is flushed, read and dispatched along with \a conn
+ * and is destroyed with it; its fd is returned by
+ * wth_connection_get_bulk_fd(). An error on it once it is in use is an
+ * error of \a conn. Calling this again only changes the threshold.
+ *
+ * On the server side, the side channel is a connection accepted like
+ * any other, which must be read and dispatched like any other. It holds
+ * no objects of its own. Once it has bound, dispatching it dispatches
+ * \a conn as well: a server using several threads must serve both from
+ * the same thread.
+ *
+ * A connection and its side channel count as one connection for
+ * threading: on the client, \a conn reads, dispatches and flushes its
+ * side channel.
+ *
+ * \memberof wth_connection
+ * \client_api
+ */
+int
+wth_connection_open_bulk_channel(struct wth_connection *conn,
+				 size_t threshold);
+
+/** Get the file descriptor of the side channel
+ *
+ * \param conn The client-side Waltham connection.
+ * \return The fd of the side channel, or -1 if there is none.
+ *
+ * Poll this fd for POLLIN along with the fd of \a conn, and call
+ * wth_connection_read() and wth_connection_dispatch() on \a conn when
+ * it is readable. When wth_connection_flush() fails with EAGAIN, the
+ * side channel may be the one that is congested; poll this fd for
+ * POLLOUT as well then. The fd changes once the side channel has
+ * connected, like the one of wth_connect_to_server_async().
+ *
+ * \memberof wth_connection
+ * \client_api
+ */
+int
+wth_connection_get_bulk_fd(struct wth_connection *conn);
+
+/** Output buffer watermark crossings
+ *
+ * \sa wth_connection_set_watermarks
+ */
+enum wth_connection_watermark {
+	/** Queued output grew to the high watermark */
+	WTH_CONNECTION_WATERMARK_HIGH,
+	/** Queued output drained down to the low watermark */
+	WTH_CONNECTION_WATERMARK_LOW
+};
+
+/** Prototype of the output watermark callback
+ *
+ * \param conn The Waltham connection.
+ * \param mark Which watermark was crossed.
+ * \param user_data The data set in
+ * wth_connection_set_watermark_callback().
+ *
+ * The callback may be called from inside any function sending a
+ * message, and from wth_connection_flush(). It must not destroy the
+ * connection.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+typedef void (*wth_watermark_callback_func)(struct wth_connection *conn,
+					    enum wth_connection_watermark mark,
+					    void *user_data);
+
+/** Set output buffer watermarks
+ *
+ * \param conn The Waltham connection.
+ * \param low Low watermark in bytes.
+ * \param high High watermark in bytes, or 0 to disable.
+ *
+ * Once the number of bytes queued for sending reaches high, the
+ * connection is considered congested and the watermark callback is
+ * called with WTH_CONNECTION_WATERMARK_HIGH. When flushing brings the
+ * queue down to low or less, the callback is called with
+ * WTH_CONNECTION_WATERMARK_LOW.
+ *
+ * This allows a server to stop generating events for a slow client
+ * instead of buffering without bounds. Watermarks are disabled by
+ * default.
+ *
+ * \sa wth_connection_set_watermark_callback
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_watermarks(struct wth_connection *conn,
+			      size_t low, size_t high);
+
+/** Set the output watermark callback
+ *
+ * \param conn The Waltham connection.
+ * \param callback The function to call on watermark crossings.
+ * \param user_data Any data to be passed to the callback.
+ *
+ * \sa wth_connection_set_watermarks
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_watermark_callback(struct wth_connection *conn,
+				      wth_watermark_callback_func callback,
+				      void *user_data);
+
+/** Prototype of the zero-copy release callback
+ *
+ * \param conn The Waltham connection.
+ * \param data The data argument that was passed to the sending function.
+ * \param user_data The data set in wth_connection_set_zerocopy().
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+typedef void (*wth_zerocopy_release_func)(struct wth_connection *conn,
+					  const void *data,
+					  void *user_data);
+
+/** Send large data arguments without copying them
+ *
+ * \param conn The Waltham connection.
+ * \param threshold Minimum size in bytes of data arguments to send
+ * without copying, or 0 to disable.
+ * \param release Called when Waltham no longer needs a buffer.
+ * \param user_data Any data to be passed to release.
  * \return 0 on success, -1 on failure with errno set.
  *
+ * Normally the bytes of a data argument, e.g. the pixels of
+ * wthp_blob_factory_create_buffer(), are copied into the output buffer
+ * when the message is sent. With zero-copy enabled, data arguments of
+ * at least threshold bytes are instead referenced in place and handed
+ * to the kernel with MSG_ZEROCOPY when flushing.
+ *
+ * The caller must then keep such a buffer allocated and unmodified
+ * until release is called with the same data pointer. This happens
+ * once the kernel has let go of the memory, or when the connection is
+ * destroyed. Data arguments smaller than threshold are copied as usual
+ * and not reported.
+ *
+ * wth_connection_destroy() does not wait for the kernel. If some sends
+ * are still in flight then, it resets the connection instead of closing
+ * it, so that unsent data is dropped rather than read from released
+ * memory. To have everything delivered, flush until nothing is queued
+ * and every buffer has been released before destroying.
+ *
+ * Kernel notifications arrive on the socket error queue, which makes
+ * the connection fd poll with POLLERR. They are processed by
+ * wth_connection_flush(), so with zero-copy enabled a POLLERR should
+ * be answered by flushing; real socket errors are reported from there.
+ *
+ * This is only supported for TCP connections on Linux. On failure,
+ * the previous setting is kept.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+int
+wth_connection_set_zerocopy(struct wth_connection *conn, size_t threshold,
+			    wth_zerocopy_release_func release,
+			    void *user_data);
+
+/** Read data received from the network
+ *
+ * \param conn The Waltham connection.
+ * \return 0 when all available data was read, 1 when more data is
+ * probably waiting, -1 on failure with errno set.
+ *
  * Reads as much data as available on the network socket into internal
- * buffers. To actually dispatch incoming messages, use
- * wth_connection_dispatch() after reading.
+ * buffers, within the budget set with wth_connection_set_read_budget().
+ * To actually dispatch incoming messages, use wth_connection_dispatch()
+ * after reading.
  *
  * This call does not block. If no data is available, the call
  * returns immediately with success.
  *
+ * The internal buffers only hold what has not been dispatched yet, so
+ * reading stops early when they are full. When this returns 1, call
+ * wth_connection_dispatch() and then this again. Edge-triggered event
+ * loops must do so until this returns 0; level-triggered ones may as
+ * well go back to polling. When the remote has closed the connection,
+ * this fails with ECONNRESET, after messages received before that have
+ * been buffered for dispatching.
+ *
  * The connection being in protocol error state does not cause this
  * function to return error, but it does cause all read data to be
  * discarded.
@@ -234,6 +640,54 @@ wth_connection_flush(struct wth_connection *conn);
 int
 wth_connection_read(struct wth_connection *conn);
 
+/** Limit the work done by one read
+ *
+ * \param conn The Waltham connection.
+ * \param max_bytes Bytes after which wth_connection_read() stops, or 0
+ * for no limit.
+ * \param max_messages Complete messages after which
+ * wth_connection_read() stops, or 0 for no limit.
+ *
+ * By default, wth_connection_read() keeps reading until the socket has
+ * nothing more or the internal buffers are full, which saves poll
+ * wakeups under load. A budget keeps one busy connection from holding
+ * up the others served by the same thread: wth_connection_read()
+ * returns 1 once it is used up.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_read_budget(struct wth_connection *conn,
+			       size_t max_bytes, int max_messages);
+
+/** Tune the size of the receive buffer
+ *
+ * \param conn The Waltham connection.
+ * \param min_size Size the buffer never shrinks below.
+ * \param max_size Size the buffer never grows beyond.
+ *
+ * Received data waits in a buffer until it is dispatched. The buffer
+ * is only held while there is such data: once everything has been
+ * dispatched, it goes back to a pool shared by all connections, so
+ * idle connections cost little memory.
+ *
+ * The buffer starts at min_size and doubles whenever a read fills it,
+ * up to max_size. A larger buffer takes more data per
+ * wth_connection_read(). After a number of idle periods in which the
+ * buffer stayed mostly unused, it halves again.
+ *
+ * Sizes are rounded up to powers of two, and max_size to at least the
+ * largest message plus one byte (64 KiB). The defaults are 4 KiB and
+ * 128 KiB; the largest size is 16 MiB.
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+void
+wth_connection_set_receive_buffer(struct wth_connection *conn,
+				  size_t min_size, size_t max_size);
+
 /** Dispatch incoming messages
  *
  * \param conn The Waltham connection.
@@ -260,6 +714,34 @@ wth_connection_read(struct wth_connection *conn);
 int
 wth_connection_dispatch(struct wth_connection *conn);
 
+/** Dispatch some of the incoming messages
+ *
+ * \param conn The Waltham connection.
+ * \param max_messages The most messages to dispatch, or 0 for no limit.
+ * \param max_ns Nanoseconds after which no further message is
+ * dispatched, or 0 for no limit.
+ * \return The number of messages still buffered, or -1 on error.
+ *
+ * Like wth_connection_dispatch(), but stops early once either limit
+ * is reached. At least one message is dispatched if any is buffered,
+ * and a message being handled is never interrupted, so the time limit
+ * can be exceeded by the last handler.
+ *
+ * The messages that were not dispatched stay buffered in order, and
+ * are dispatched first by the next call to this or
+ * wth_connection_dispatch(). A server serving many clients can take
+ * turns among the connections that still have messages left, so that
+ * one busy client does not delay all the others.
+ *
+ * Errors are reported as for wth_connection_dispatch().
+ *
+ * \memberof wth_connection
+ * \common_api
+ */
+int
+wth_connection_dispatch_budget(struct wth_connection *conn,
+			       int max_messages, uint64_t max_ns);
+
 /** Make a roundtrip from a client
  *
  * \param conn The Waltham connection.
@@ -34,49 +34,77 @@
 
 #include "waltham-object.h"
 
+/* User state follows the object, aligned like malloc'd memory */
+#define USER_STATE_OFFSET \
+	((sizeof(struct wth_object) + 15) & ~(size_t) 15)
+
 struct wth_object *
-wth_object_new_with_id(struct wth_connection *connection, uint32_t id)
+wth_object_new_with_user_size(struct wth_connection *connection, uint32_t id,
+			      size_t user_size)
 {
 	struct wth_object *proxy = NULL;
 
-	proxy = malloc(sizeof *proxy);
+	proxy = wth_connection_alloc_object(connection,
+		user_size ? USER_STATE_OFFSET + user_size : sizeof *proxy);
 	if (proxy == NULL)
 		return NULL;
 
-	memset(proxy, 0, sizeof *proxy);
-
+	proxy->has_user_state = user_size > 0;
 	proxy->id = id;
 	proxy->connection = connection;
 
-	wth_connection_insert_object_with_id(connection, proxy);
+	if (id == 0) {
+		wth_connection_insert_new_object(connection, proxy);
+	} else if (wth_connection_insert_object_with_id(connection, proxy) < 0) {
+		wth_connection_free_object(connection, proxy);
+		errno = EINVAL;
+		return NULL;
+	}
 
 	return proxy;
 }
 
+struct wth_object *
+wth_object_new_with_id(struct wth_connection *connection, uint32_t id)
+{
+	return wth_object_new_with_user_size(connection, id,
+		wth_connection_get_object_user_size(connection));
+}
+
 struct wth_object *
 wth_object_new(struct wth_connection *connection)
 {
-	struct wth_object *proxy = NULL;
+	return wth_object_new_with_user_size(connection, 0,
+		wth_connection_get_object_user_size(connection));
+}
 
-	proxy = malloc(sizeof *proxy);
-	if (proxy == NULL)
-		return NULL;
+WTH_EXPORT void
+wth_object_delete(struct wth_object *object)
+{
+	struct wth_connection *conn = object->connection;
 
-	memset(proxy, 0, sizeof *proxy);
+	wth_connection_remove_object(conn, object);
 
-	proxy->connection = connection;
+	wth_connection_free_object(conn, object);
+}
 
-	wth_connection_insert_new_object(connection, proxy);
+WTH_EXPORT void
+wth_object_set_destroy_hook(struct wth_object *obj,
+			    wth_object_destroy_func hook)
+{
+	obj->destroy_hook = hook;
 
-	return proxy;
+	if (hook)
+		wth_connection_use_destroy_hooks(obj->connection);
 }
 
-WTH_EXPORT void
-wth_object_delete(struct wth_object *object)
+WTH_EXPORT void *
+wth_object_get_user_state(struct wth_object *obj)
 {
-	wth_connection_remove_object(object->connection, object);
+	if (!obj->has_user_state)
+		return NULL;
 
-	free(object);
+	return (char *) obj + USER_STATE_OFFSET;
 }
 
 WTH_EXPORT void
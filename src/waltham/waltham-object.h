@@ -49,6 +49,14 @@ extern "C" {
  */
 struct wth_object;
 
+/** Destroy hook of a protocol object
+ *
+ * \param obj The protocol object being torn down.
+ *
+ * See wth_object_set_destroy_hook().
+ */
+typedef void (*wth_object_destroy_func)(struct wth_object *obj);
+
 /** Destroy a protocol object
  *
  * \param object The protocol object cast from a specific
@@ -109,6 +117,47 @@ wth_object_set_listener(struct wth_object *obj,
 void *
 wth_object_get_user_data(struct wth_object *obj);
 
+/** Get the user state allocated with a protocol object
+ *
+ * \param obj The protocol object cast from a specific
+ * interface type.
+ * \return The object's user state, or NULL if it has none.
+ *
+ * Objects created on a connection after
+ * wth_connection_set_object_user_size() come with that many bytes of
+ * user state, zeroed, in the same allocation as the object. It is
+ * freed together with the object.
+ *
+ * \memberof wth_object
+ * \common_api
+ */
+void *
+wth_object_get_user_state(struct wth_object *obj);
+
+/** Let the connection destroy a protocol object
+ *
+ * \param obj The protocol object cast from a specific
+ * interface type.
+ * \param hook The function that destroys the object, or NULL.
+ *
+ * When the connection is destroyed with wth_connection_destroy(), it
+ * calls the hook of every object that still has one, in object ID
+ * order. The hook frees whatever user code keeps for the object and
+ * destroys the object, just like when the object is destroyed for any
+ * other reason. User code then needs no lists of its own to clean up
+ * after a connection.
+ *
+ * A hook may also destroy other objects, but it must not create any.
+ * Objects without a hook must still be destroyed before the
+ * connection.
+ *
+ * \memberof wth_object
+ * \common_api
+ */
+void
+wth_object_set_destroy_hook(struct wth_object *obj,
+			    wth_object_destroy_func hook);
+
 /** Post a fatal protocol error to a client
  *
  * \param obj The object that specifies the error code.
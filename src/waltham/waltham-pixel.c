@@ -0,0 +1,820 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#include "waltham-pixel.h"
+#include "waltham-private.h"
+
+/* Channels in a, r, g, b order */
+struct pixel_layout {
+	uint32_t format;
+	int bpp;
+	uint8_t bits[4]; /* 0 when the format has no such channel */
+	uint8_t shift[4];
+};
+
+static const struct pixel_layout layouts[] = {
+	{ WTH_PIXEL_FORMAT_ARGB8888, 4, { 8, 8, 8, 8 }, { 24, 16, 8, 0 } },
+	{ WTH_PIXEL_FORMAT_XRGB8888, 4, { 0, 8, 8, 8 }, { 24, 16, 8, 0 } },
+	{ WTH_PIXEL_FORMAT_XRGB4444, 2, { 0, 4, 4, 4 }, { 12, 8, 4, 0 } },
+	{ WTH_PIXEL_FORMAT_ARGB4444, 2, { 4, 4, 4, 4 }, { 12, 8, 4, 0 } },
+	{ WTH_PIXEL_FORMAT_XRGB1555, 2, { 0, 5, 5, 5 }, { 15, 10, 5, 0 } },
+	{ WTH_PIXEL_FORMAT_ARGB1555, 2, { 1, 5, 5, 5 }, { 15, 10, 5, 0 } },
+	{ WTH_PIXEL_FORMAT_RGB565, 2, { 0, 5, 6, 5 }, { 0, 11, 5, 0 } },
+};
+
+/* Channel positions in a 32-bit pixel */
+static const uint8_t argb_shift[4] = { 24, 16, 8, 0 };
+
+/*
+ * Tiles are hashed in blocks of HASH_LANES 32-bit words, each word
+ * going into its own accumulator, so that the vector kernels need no
+ * horizontal operations and have independent dependency chains.
+ */
+#define HASH_LANES 32
+#define HASH_BLOCK (HASH_LANES * 4)
+#define HASH_PRIME1 0x9e3779b1u
+#define HASH_PRIME2 0x85ebca77u
+
+#define DEFAULT_TILE_SIZE 64
+
+struct wth_tile_tracker {
+	int width;
+	int height;
+	int bpp;
+	int tile_size;
+	int tiles_x;
+	int tiles_y;
+
+	/* Whether hashes holds the previous frame */
+	int valid;
+	uint64_t *hashes;
+
+	/* For one row of tiles */
+	uint32_t *acc;
+	uint8_t *dirty;
+
+	int32_t *rects;
+};
+
+struct pixel_kernels {
+	enum wth_pixel_simd simd;
+	void (*pack)(uint16_t *dst, const uint32_t *src, int n,
+		     const struct pixel_layout *l, uint32_t fill);
+	void (*unpack)(uint32_t *dst, const uint16_t *src, int n,
+		       const struct pixel_layout *l);
+	void (*hash)(uint32_t *acc, const uint8_t *data, int tiles,
+		     size_t blocks, size_t step);
+};
+
+static const struct pixel_layout *
+find_layout(uint32_t format)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(layouts); i++)
+		if (layouts[i].format == format)
+			return &layouts[i];
+
+	return NULL;
+}
+
+/* Scalar kernels, also used for the pixels that do not fill a vector.
+ * The pack kernels set the fill bits in each source pixel first, the
+ * alpha of sources without alpha. */
+
+static void
+pack_row_scalar(uint16_t *dst, const uint32_t *src, int n,
+		const struct pixel_layout *l, uint32_t fill)
+{
+	uint32_t p, v;
+	int i, c;
+
+	for (i = 0; i < n; i++) {
+		p = src[i] | fill;
+		v = 0;
+		for (c = 0; c < 4; c++) {
+			if (l->bits[c] == 0)
+				continue;
+			v |= ((p >> (argb_shift[c] + 8 - l->bits[c])) &
+			      ((1u << l->bits[c]) - 1)) << l->shift[c];
+		}
+		dst[i] = v;
+	}
+}
+
+static void
+unpack_row_scalar(uint32_t *dst, const uint16_t *src, int n,
+		  const struct pixel_layout *l)
+{
+	uint32_t p, v, t;
+	int i, c, s;
+
+	for (i = 0; i < n; i++) {
+		p = src[i];
+		v = 0;
+		for (c = 0; c < 4; c++) {
+			if (l->bits[c] == 0) {
+				t = 0xff;
+			} else {
+				t = ((p >> l->shift[c]) &
+				     ((1u << l->bits[c]) - 1)) << (8 - l->bits[c]);
+				/* Replicate the high bits into the low ones */
+				for (s = l->bits[c]; s < 8; s *= 2)
+					t |= t >> s;
+			}
+			v |= t << argb_shift[c];
+		}
+		dst[i] = v;
+	}
+}
+
+static inline uint32_t
+hash_round(uint32_t acc, uint32_t v)
+{
+	acc += v;
+	acc = (acc << 13) | (acc >> 19);
+	return acc * HASH_PRIME1;
+}
+
+/* The hash kernels take the blocks of several tiles along a row at
+ * once, step bytes apart, each tile with its own HASH_LANES
+ * accumulators. One call per row keeps them from costing more than the
+ * memory reads. */
+static void
+hash_blocks_scalar(uint32_t *acc, const uint8_t *data, int tiles,
+		   size_t blocks, size_t step)
+{
+	const uint8_t *p;
+	uint32_t v;
+	size_t i;
+	int t, l;
+
+	for (t = 0; t < tiles; t++, acc += HASH_LANES, data += step) {
+		for (i = 0, p = data; i < blocks; i++, p += HASH_BLOCK) {
+			for (l = 0; l < HASH_LANES; l++) {
+				memcpy(&v, p + l * 4, 4);
+				acc[l] = hash_round(acc[l], v);
+			}
+		}
+	}
+}
+
+static const struct pixel_kernels kernels_scalar = {
+	WTH_PIXEL_SIMD_NONE,
+	pack_row_scalar,
+	unpack_row_scalar,
+	hash_blocks_scalar
+};
+
+#ifdef HAVE_X86_SIMD
+
+/* Shift counts and masks of the channels a format has */
+struct channel_vectors {
+	int count;
+	__m128i src_shift[4]; /* the kept bits down to bit 0 */
+	__m128i dst_shift[4]; /* from bit 0 to the channel position */
+	__m128i bits_shift[4]; /* from bit 0 to the top of a byte */
+	__m128i repl_shift[4][3]; /* bit replication steps */
+	int nrepl[4];
+	uint32_t mask[4];
+	uint32_t opaque; /* alpha of formats without alpha */
+};
+
+__attribute__((target("sse2"))) static void
+channel_vectors_init(struct channel_vectors *cv,
+		     const struct pixel_layout *l, int pack)
+{
+	int c, s;
+
+	memset(cv, 0, sizeof *cv);
+
+	if (l->bits[0] == 0)
+		cv->opaque = 0xff000000;
+
+	for (c = 0; c < 4; c++) {
+		int bits = l->bits[c];
+		int k = cv->count;
+
+		if (bits == 0)
+			continue;
+
+		cv->mask[k] = (1u << bits) - 1;
+		if (pack) {
+			cv->src_shift[k] =
+				_mm_cvtsi32_si128(argb_shift[c] + 8 - bits);
+			cv->dst_shift[k] = _mm_cvtsi32_si128(l->shift[c]);
+		} else {
+			cv->src_shift[k] = _mm_cvtsi32_si128(l->shift[c]);
+			cv->dst_shift[k] = _mm_cvtsi32_si128(argb_shift[c]);
+			cv->bits_shift[k] = _mm_cvtsi32_si128(8 - bits);
+			for (s = bits; s < 8; s *= 2)
+				cv->repl_shift[k][cv->nrepl[k]++] =
+					_mm_cvtsi32_si128(s);
+		}
+		cv->count++;
+	}
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+pack_sse2(__m128i p, const struct channel_vectors *cv)
+{
+	__m128i v = _mm_setzero_si128();
+	int k;
+
+	for (k = 0; k < cv->count; k++) {
+		__m128i t = _mm_srl_epi32(p, cv->src_shift[k]);
+
+		t = _mm_and_si128(t, _mm_set1_epi32(cv->mask[k]));
+		v = _mm_or_si128(v, _mm_sll_epi32(t, cv->dst_shift[k]));
+	}
+
+	/* Sign extend, so that packing does not saturate */
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("sse2"))) static void
+pack_row_sse2(uint16_t *dst, const uint32_t *src, int n,
+	      const struct pixel_layout *l, uint32_t fill)
+{
+	struct channel_vectors cv;
+	__m128i f = _mm_set1_epi32(fill);
+	int i;
+
+	channel_vectors_init(&cv, l, 1);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i a = _mm_or_si128(f,
+			_mm_loadu_si128((const __m128i *) (src + i)));
+		__m128i b = _mm_or_si128(f,
+			_mm_loadu_si128((const __m128i *) (src + i + 4)));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packs_epi32(pack_sse2(a, &cv),
+						 pack_sse2(b, &cv)));
+	}
+
+	pack_row_scalar(dst + i, src + i, n - i, l, fill);
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+unpack_sse2(__m128i p, const struct channel_vectors *cv)
+{
+	__m128i v = _mm_set1_epi32(cv->opaque);
+	int k, s;
+
+	for (k = 0; k < cv->count; k++) {
+		__m128i t = _mm_srl_epi32(p, cv->src_shift[k]);
+
+		t = _mm_and_si128(t, _mm_set1_epi32(cv->mask[k]));
+		t = _mm_sll_epi32(t, cv->bits_shift[k]);
+		for (s = 0; s < cv->nrepl[k]; s++)
+			t = _mm_or_si128(t, _mm_srl_epi32(t, cv->repl_shift[k][s]));
+		v = _mm_or_si128(v, _mm_sll_epi32(t, cv->dst_shift[k]));
+	}
+
+	return v;
+}
+
+__attribute__((target("sse2"))) static void
+unpack_row_sse2(uint32_t *dst, const uint16_t *src, int n,
+		const struct pixel_layout *l)
+{
+	struct channel_vectors cv;
+	__m128i zero = _mm_setzero_si128();
+	int i;
+
+	channel_vectors_init(&cv, l, 0);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 unpack_sse2(_mm_unpacklo_epi16(p, zero), &cv));
+		_mm_storeu_si128((__m128i *) (dst + i + 4),
+				 unpack_sse2(_mm_unpackhi_epi16(p, zero), &cv));
+	}
+
+	unpack_row_scalar(dst + i, src + i, n - i, l);
+}
+
+/* SSE2 has no 32-bit multiply keeping the low halves */
+__attribute__((target("sse2"))) static inline __m128i
+mullo_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32),
+				    _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08),
+				  _mm_shuffle_epi32(odd, 0x08));
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+hash_round_sse2(__m128i acc, __m128i v)
+{
+	acc = _mm_add_epi32(acc, v);
+	acc = _mm_or_si128(_mm_slli_epi32(acc, 13), _mm_srli_epi32(acc, 19));
+	return mullo_sse2(acc, _mm_set1_epi32(HASH_PRIME1));
+}
+
+__attribute__((target("sse2"))) static void
+hash_blocks_sse2(uint32_t *acc, const uint8_t *data, int tiles,
+		 size_t blocks, size_t step)
+{
+	__m128i a[HASH_LANES / 4];
+	const uint8_t *p;
+	size_t i;
+	int t, l;
+
+	for (t = 0; t < tiles; t++, acc += HASH_LANES, data += step) {
+		for (l = 0; l < HASH_LANES / 4; l++)
+			a[l] = _mm_loadu_si128((const __m128i *) (acc + l * 4));
+
+		for (i = 0, p = data; i < blocks; i++, p += HASH_BLOCK)
+			for (l = 0; l < HASH_LANES / 4; l++)
+				a[l] = hash_round_sse2(a[l],
+					_mm_loadu_si128((const __m128i *) (p + l * 16)));
+
+		for (l = 0; l < HASH_LANES / 4; l++)
+			_mm_storeu_si128((__m128i *) (acc + l * 4), a[l]);
+	}
+}
+
+static const struct pixel_kernels kernels_sse2 = {
+	WTH_PIXEL_SIMD_SSE2,
+	pack_row_sse2,
+	unpack_row_sse2,
+	hash_blocks_sse2
+};
+
+__attribute__((target("avx2"))) static inline __m256i
+pack_avx2(__m256i p, const struct channel_vectors *cv)
+{
+	__m256i v = _mm256_setzero_si256();
+	int k;
+
+	for (k = 0; k < cv->count; k++) {
+		__m256i t = _mm256_srl_epi32(p, cv->src_shift[k]);
+
+		t = _mm256_and_si256(t, _mm256_set1_epi32(cv->mask[k]));
+		v = _mm256_or_si256(v, _mm256_sll_epi32(t, cv->dst_shift[k]));
+	}
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2"))) static void
+pack_row_avx2(uint16_t *dst, const uint32_t *src, int n,
+	      const struct pixel_layout *l, uint32_t fill)
+{
+	struct channel_vectors cv;
+	__m256i f = _mm256_set1_epi32(fill);
+	int i;
+
+	channel_vectors_init(&cv, l, 1);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_or_si256(f,
+			_mm256_loadu_si256((const __m256i *) (src + i)));
+		__m256i b = _mm256_or_si256(f,
+			_mm256_loadu_si256((const __m256i *) (src + i + 8)));
+		__m256i v = _mm256_packs_epi32(pack_avx2(a, &cv),
+					       pack_avx2(b, &cv));
+
+		/* Packing works within 128-bit lanes, restore the order */
+		_mm256_storeu_si256((__m256i *) (dst + i),
+				    _mm256_permute4x64_epi64(v, 0xd8));
+	}
+
+	pack_row_sse2(dst + i, src + i, n - i, l, fill);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+unpack_avx2(__m256i p, const struct channel_vectors *cv)
+{
+	__m256i v = _mm256_set1_epi32(cv->opaque);
+	int k, s;
+
+	for (k = 0; k < cv->count; k++) {
+		__m256i t = _mm256_srl_epi32(p, cv->src_shift[k]);
+
+		t = _mm256_and_si256(t, _mm256_set1_epi32(cv->mask[k]));
+		t = _mm256_sll_epi32(t, cv->bits_shift[k]);
+		for (s = 0; s < cv->nrepl[k]; s++)
+			t = _mm256_or_si256(t, _mm256_srl_epi32(t, cv->repl_shift[k][s]));
+		v = _mm256_or_si256(v, _mm256_sll_epi32(t, cv->dst_shift[k]));
+	}
+
+	return v;
+}
+
+__attribute__((target("avx2"))) static void
+unpack_row_avx2(uint32_t *dst, const uint16_t *src, int n,
+		const struct pixel_layout *l)
+{
+	struct channel_vectors cv;
+	int i;
+
+	channel_vectors_init(&cv, l, 0);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + i + 8));
+
+		_mm256_storeu_si256((__m256i *) (dst + i),
+				    unpack_avx2(_mm256_cvtepu16_epi32(a), &cv));
+		_mm256_storeu_si256((__m256i *) (dst + i + 8),
+				    unpack_avx2(_mm256_cvtepu16_epi32(b), &cv));
+	}
+
+	unpack_row_sse2(dst + i, src + i, n - i, l);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hash_round_avx2(__m256i acc, __m256i v)
+{
+	acc = _mm256_add_epi32(acc, v);
+	acc = _mm256_or_si256(_mm256_slli_epi32(acc, 13),
+			      _mm256_srli_epi32(acc, 19));
+	return _mm256_mullo_epi32(acc, _mm256_set1_epi32(HASH_PRIME1));
+}
+
+__attribute__((target("avx2"))) static void
+hash_blocks_avx2(uint32_t *acc, const uint8_t *data, int tiles,
+		 size_t blocks, size_t step)
+{
+	__m256i a[HASH_LANES / 8];
+	const uint8_t *p;
+	size_t i;
+	int t, l;
+
+	for (t = 0; t < tiles; t++, acc += HASH_LANES, data += step) {
+		for (l = 0; l < HASH_LANES / 8; l++)
+			a[l] = _mm256_loadu_si256((const __m256i *) (acc + l * 8));
+
+		for (i = 0, p = data; i < blocks; i++, p += HASH_BLOCK)
+			for (l = 0; l < HASH_LANES / 8; l++)
+				a[l] = hash_round_avx2(a[l],
+					_mm256_loadu_si256((const __m256i *) (p + l * 32)));
+
+		for (l = 0; l < HASH_LANES / 8; l++)
+			_mm256_storeu_si256((__m256i *) (acc + l * 8), a[l]);
+	}
+}
+
+static const struct pixel_kernels kernels_avx2 = {
+	WTH_PIXEL_SIMD_AVX2,
+	pack_row_avx2,
+	unpack_row_avx2,
+	hash_blocks_avx2
+};
+
+#endif /* HAVE_X86_SIMD */
+
+static const struct pixel_kernels *kernels;
+
+WTH_EXPORT enum wth_pixel_simd
+wth_pixel_set_simd(enum wth_pixel_simd simd)
+{
+	kernels = &kernels_scalar;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (simd >= WTH_PIXEL_SIMD_AVX2 && __builtin_cpu_supports("avx2"))
+		kernels = &kernels_avx2;
+	else if (simd >= WTH_PIXEL_SIMD_SSE2 && __builtin_cpu_supports("sse2"))
+		kernels = &kernels_sse2;
+#endif
+
+	return kernels->simd;
+}
+
+WTH_EXPORT int
+wth_pixel_format_get_bpp(uint32_t format)
+{
+	const struct pixel_layout *l = find_layout(format);
+
+	return l ? l->bpp : 0;
+}
+
+static void
+convert_row(uint8_t *dst, const struct pixel_layout *dl,
+	    const uint8_t *src, const struct pixel_layout *sl, int width)
+{
+	const uint32_t *p;
+	uint32_t *q;
+	int i;
+
+	if (dl == sl) {
+		memcpy(dst, src, width * dl->bpp);
+	} else if (dl->bpp == 2) {
+		/* The X byte is undefined, alpha comes out opaque */
+		kernels->pack((uint16_t *) dst, (const uint32_t *) src,
+			      width, dl, sl->bits[0] ? 0 : 0xff000000);
+	} else if (sl->bpp == 2) {
+		kernels->unpack((uint32_t *) dst, (const uint16_t *) src,
+				width, sl);
+	} else {
+		/* Between argb8888 and xrgb8888 */
+		p = (const uint32_t *) src;
+		q = (uint32_t *) dst;
+		for (i = 0; i < width; i++)
+			q[i] = p[i] | 0xff000000;
+	}
+}
+
+WTH_EXPORT int
+wth_pixel_convert(void *dst, uint32_t dst_format, int dst_stride,
+		  const void *src, uint32_t src_format, int src_stride,
+		  int width, int height)
+{
+	const struct pixel_layout *dl = find_layout(dst_format);
+	const struct pixel_layout *sl = find_layout(src_format);
+	int y;
+
+	if (dl == NULL || sl == NULL ||
+	    (dl != sl && dl->bpp == 2 && sl->bpp == 2))
+		return -1;
+
+	if (kernels == NULL)
+		wth_pixel_set_simd(WTH_PIXEL_SIMD_AVX2);
+
+	for (y = 0; y < height; y++)
+		convert_row((uint8_t *) dst + y * dst_stride, dl,
+			    (const uint8_t *) src + y * src_stride, sl,
+			    width);
+
+	return 0;
+}
+
+/* Bits kept by a format, counting alpha only when needed */
+static int
+format_score(const struct pixel_layout *l, int alpha)
+{
+	return l->bits[1] + l->bits[2] + l->bits[3] + (alpha ? l->bits[0] : 0);
+}
+
+WTH_EXPORT uint32_t
+wth_pixel_choose_format(const uint32_t *formats, int count,
+			uint32_t src_format)
+{
+	const struct pixel_layout *sl = find_layout(src_format);
+	const struct pixel_layout *best = NULL;
+	const struct pixel_layout *l;
+	int alpha;
+	int i;
+
+	if (sl == NULL || sl->bpp == 2)
+		return src_format;
+
+	alpha = sl->bits[0] > 0;
+
+	for (i = 0; i < count; i++) {
+		l = find_layout(formats[i]);
+		if (l == NULL || l->bpp >= sl->bpp ||
+		    (alpha && l->bits[0] == 0))
+			continue;
+
+		/* Smallest first, then the most bits, then more alpha */
+		if (best == NULL || l->bpp < best->bpp ||
+		    (l->bpp == best->bpp &&
+		     (format_score(l, alpha) > format_score(best, alpha) ||
+		      (format_score(l, alpha) == format_score(best, alpha) &&
+		       l->bits[0] > best->bits[0]))))
+			best = l;
+	}
+
+	return best ? best->format : src_format;
+}
+
+WTH_EXPORT size_t
+wth_pixel_copy_rects(void *dst, const void *src, int stride,
+		     uint32_t format, const int32_t *rects, int count)
+{
+	int bpp = wth_pixel_format_get_bpp(format);
+	uint8_t *out = dst;
+	size_t size = 0;
+	int i, y;
+
+	for (i = 0; i < count; i++) {
+		const int32_t *r = rects + i * 4;
+		size_t row = (size_t) r[2] * bpp;
+
+		size += row * r[3];
+		if (dst == NULL)
+			continue;
+
+		for (y = r[1]; y < r[1] + r[3]; y++) {
+			memcpy(out, (const uint8_t *) src + (size_t) y * stride +
+			       (size_t) r[0] * bpp, row);
+			out += row;
+		}
+	}
+
+	return size;
+}
+
+WTH_EXPORT struct wth_tile_tracker *
+wth_tile_tracker_create(int width, int height, uint32_t format,
+			int tile_size)
+{
+	struct wth_tile_tracker *t;
+	int bpp = wth_pixel_format_get_bpp(format);
+
+	if (bpp == 0 || width <= 0 || height <= 0 || tile_size < 0)
+		return NULL;
+
+	t = calloc(1, sizeof *t);
+	if (!t)
+		return NULL;
+
+	t->width = width;
+	t->height = height;
+	t->bpp = bpp;
+	t->tile_size = tile_size ? tile_size : DEFAULT_TILE_SIZE;
+	t->tiles_x = (width + t->tile_size - 1) / t->tile_size;
+	t->tiles_y = (height + t->tile_size - 1) / t->tile_size;
+
+	t->hashes = calloc(t->tiles_x * t->tiles_y, sizeof *t->hashes);
+	t->acc = calloc(t->tiles_x * HASH_LANES, sizeof *t->acc);
+	t->dirty = calloc(t->tiles_x, sizeof *t->dirty);
+	t->rects = calloc(t->tiles_x * t->tiles_y * 4, sizeof *t->rects);
+	if (!t->hashes || !t->acc || !t->dirty || !t->rects) {
+		wth_tile_tracker_destroy(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+WTH_EXPORT void
+wth_tile_tracker_destroy(struct wth_tile_tracker *t)
+{
+	free(t->hashes);
+	free(t->acc);
+	free(t->dirty);
+	free(t->rects);
+	free(t);
+}
+
+WTH_EXPORT void
+wth_tile_tracker_reset(struct wth_tile_tracker *t)
+{
+	t->valid = 0;
+}
+
+static uint64_t
+hash_final(const uint32_t *acc)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int l;
+
+	for (l = 0; l < HASH_LANES; l++)
+		h = (h ^ acc[l]) * 0x100000001b3ull;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void
+hash_tile_row(struct wth_tile_tracker *t, const uint8_t *row)
+{
+	uint8_t tail[HASH_BLOCK];
+	size_t step = (size_t) t->tile_size * t->bpp;
+	size_t len, blocks, rest;
+	int tx = 0;
+
+	/* The whole tiles in one call when they are whole blocks */
+	if (step % HASH_BLOCK == 0) {
+		tx = t->width / t->tile_size;
+		kernels->hash(t->acc, row, tx, step / HASH_BLOCK, step);
+	}
+
+	for (; tx < t->tiles_x; tx++) {
+		const uint8_t *p = row + (size_t) tx * t->tile_size * t->bpp;
+		uint32_t *acc = t->acc + tx * HASH_LANES;
+
+		len = (size_t) MIN(t->tile_size, t->width - tx * t->tile_size) *
+		      t->bpp;
+		blocks = len / HASH_BLOCK;
+		rest = len % HASH_BLOCK;
+
+		kernels->hash(acc, p, 1, blocks, 0);
+		if (rest) {
+			memcpy(tail, p + blocks * HASH_BLOCK, rest);
+			memset(tail + rest, 0, HASH_BLOCK - rest);
+			hash_blocks_scalar(acc, tail, 1, 1, 0);
+		}
+	}
+}
+
+/* Turn the dirty tiles of a row into rectangles, growing the ones of
+ * the row above when they line up. */
+static int
+add_row_rects(struct wth_tile_tracker *t, int ty, int count)
+{
+	int y = ty * t->tile_size;
+	int h = MIN(t->tile_size, t->height - y);
+	int tx, start, x, w, i;
+	int32_t *r;
+
+	for (tx = 0; tx < t->tiles_x; tx++) {
+		if (!t->dirty[tx])
+			continue;
+
+		start = tx;
+		while (tx < t->tiles_x && t->dirty[tx])
+			tx++;
+
+		x = start * t->tile_size;
+		w = MIN(tx * t->tile_size, t->width) - x;
+
+		for (i = 0; i < count; i++) {
+			r = t->rects + i * 4;
+			if (r[0] == x && r[2] == w && r[1] + r[3] == y)
+				break;
+		}
+
+		if (i < count) {
+			r[3] += h;
+		} else {
+			r = t->rects + count++ * 4;
+			r[0] = x;
+			r[1] = y;
+			r[2] = w;
+			r[3] = h;
+		}
+	}
+
+	return count;
+}
+
+WTH_EXPORT int
+wth_tile_tracker_update(struct wth_tile_tracker *t, const void *data,
+			int stride, const int32_t **damage)
+{
+	const uint8_t *rows = data;
+	uint64_t h;
+	int count = 0;
+	int tx, ty, y, l;
+
+	if (kernels == NULL)
+		wth_pixel_set_simd(WTH_PIXEL_SIMD_AVX2);
+
+	for (ty = 0; ty < t->tiles_y; ty++) {
+		for (tx = 0; tx < t->tiles_x; tx++)
+			for (l = 0; l < HASH_LANES; l++)
+				t->acc[tx * HASH_LANES + l] =
+					HASH_PRIME1 + l * HASH_PRIME2;
+
+		for (y = ty * t->tile_size;
+		     y < MIN((ty + 1) * t->tile_size, t->height); y++)
+			hash_tile_row(t, rows + (size_t) y * stride);
+
+		for (tx = 0; tx < t->tiles_x; tx++) {
+			h = hash_final(t->acc + tx * HASH_LANES);
+			t->dirty[tx] = !t->valid ||
+				       t->hashes[ty * t->tiles_x + tx] != h;
+			t->hashes[ty * t->tiles_x + tx] = h;
+		}
+
+		count = add_row_rects(t, ty, count);
+	}
+
+	t->valid = 1;
+	*damage = t->rects;
+
+	return count;
+}
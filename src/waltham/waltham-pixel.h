@@ -0,0 +1,227 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file waltham-pixel.h
+ *
+ * \brief Pixel helpers for wthp_blob_factory buffers
+ *
+ * Pixels can be sent in a cheaper format than the one they were
+ * rendered in, e.g. rgb565 instead of xrgb8888, halving the data to
+ * send, and converted back on the receiving side.
+ *
+ * A wth_tile_tracker finds the parts of a frame that changed since the
+ * previous one, for sending them with wthp_blob_factory.update_buffer
+ * when the damage is not known.
+ *
+ * The conversions and the hashing are vectorized where the CPU allows
+ * it.
+ */
+
+#ifndef WALTHAM_PIXEL_H
+#define WALTHAM_PIXEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct wth_tile_tracker;
+
+/** \enum wth_pixel_format
+ *
+ * Pixel formats that can be converted, with the values of the
+ * wthp_blob_factory format enum.
+ */
+enum wth_pixel_format {
+	WTH_PIXEL_FORMAT_ARGB8888 = 0,
+	WTH_PIXEL_FORMAT_XRGB8888 = 1,
+	WTH_PIXEL_FORMAT_XRGB4444 = 0x32315258,
+	WTH_PIXEL_FORMAT_ARGB4444 = 0x32315241,
+	WTH_PIXEL_FORMAT_XRGB1555 = 0x35315258,
+	WTH_PIXEL_FORMAT_ARGB1555 = 0x35315241,
+	WTH_PIXEL_FORMAT_RGB565 = 0x36314752
+};
+
+/** \enum wth_pixel_simd
+ *
+ * Instruction sets the conversions may use.
+ */
+enum wth_pixel_simd {
+	/** Plain C */
+	WTH_PIXEL_SIMD_NONE,
+	/** x86 SSE2 */
+	WTH_PIXEL_SIMD_SSE2,
+	/** x86 AVX2 */
+	WTH_PIXEL_SIMD_AVX2
+};
+
+/** Get the size of a pixel
+ *
+ * \param format A pixel format.
+ * \return The number of bytes per pixel, or 0 if the format cannot be
+ * converted.
+ */
+int
+wth_pixel_format_get_bpp(uint32_t format);
+
+/** Convert pixels between formats
+ *
+ * \param dst The destination pixels.
+ * \param dst_format The destination format.
+ * \param dst_stride The destination row stride in bytes.
+ * \param src The source pixels.
+ * \param src_format The source format.
+ * \param src_stride The source row stride in bytes.
+ * \param width The width of the image in pixels.
+ * \param height The height of the image in pixels.
+ * \return 0 on success, -1 if the conversion is not supported.
+ *
+ * Converts between the 32-bit formats and any other format in
+ * wth_pixel_format. Converting to a format with fewer bits per channel
+ * truncates, converting back replicates the high bits into the low
+ * ones, so that full intensity stays full intensity. Formats without
+ * alpha convert to opaque pixels. Rows must be aligned to the size of
+ * a pixel.
+ */
+int
+wth_pixel_convert(void *dst, uint32_t dst_format, int dst_stride,
+		  const void *src, uint32_t src_format, int src_stride,
+		  int width, int height);
+
+/** Choose a format to send pixels in
+ *
+ * \param formats The formats the server announced with
+ * wthp_blob_factory.format events.
+ * \param count The number of formats.
+ * \param src_format The format of the pixels to send.
+ * \return The format to send the pixels in.
+ *
+ * Returns the smallest announced format that src_format can be
+ * converted to, keeping alpha if src_format has alpha. Returns
+ * src_format when there is no such format.
+ */
+uint32_t
+wth_pixel_choose_format(const uint32_t *formats, int count,
+			uint32_t src_format);
+
+/** Copy rectangles of pixels into one tightly packed block
+ *
+ * \param dst Where to copy to, or NULL to only compute the size.
+ * \param src The pixels of the whole buffer.
+ * \param stride The row stride of src in bytes.
+ * \param format The pixel format.
+ * \param rects The rectangles, as four int32_t each: x, y, width and
+ * height.
+ * \param count The number of rectangles.
+ * \return The number of bytes copied.
+ *
+ * The layout is the one wthp_blob_factory.update_buffer expects for
+ * its data.
+ */
+size_t
+wth_pixel_copy_rects(void *dst, const void *src, int stride,
+		     uint32_t format, const int32_t *rects, int count);
+
+/** Create a tile tracker
+ *
+ * \param width The width of the frames in pixels.
+ * \param height The height of the frames in pixels.
+ * \param format The pixel format of the frames.
+ * \param tile_size The width and height of a tile in pixels, or 0 for
+ * the default of 64.
+ * \return A new tile tracker, or NULL on failure.
+ *
+ * A tile tracker splits frames into tiles and remembers a hash of each
+ * tile. Use one tracker per wthp_buffer, or per wthp_surface when a
+ * new buffer is created for each frame. Tile rows of a multiple of
+ * 128 bytes hash fastest.
+ *
+ * \memberof wth_tile_tracker
+ */
+struct wth_tile_tracker *
+wth_tile_tracker_create(int width, int height, uint32_t format,
+			int tile_size);
+
+/** Destroy a tile tracker
+ *
+ * \param tracker The tile tracker.
+ *
+ * \memberof wth_tile_tracker
+ */
+void
+wth_tile_tracker_destroy(struct wth_tile_tracker *tracker);
+
+/** Find the changed parts of a frame
+ *
+ * \param tracker The tile tracker.
+ * \param data The pixels of the frame.
+ * \param stride The row stride in bytes.
+ * \param damage Set to the changed rectangles, as four int32_t each:
+ * x, y, width and height. Valid until the next call.
+ * \return The number of rectangles, 0 when nothing changed.
+ *
+ * Compares the tiles of the frame against the previous frame passed
+ * in, and returns the tiles that differ merged into non-overlapping
+ * rectangles. The first frame, and the first one after
+ * wth_tile_tracker_reset(), is damaged as a whole.
+ *
+ * Tiles are compared by a 64-bit hash, so a change that keeps the hash
+ * goes unnoticed, which is vanishingly unlikely but possible.
+ *
+ * \memberof wth_tile_tracker
+ */
+int
+wth_tile_tracker_update(struct wth_tile_tracker *tracker, const void *data,
+			int stride, const int32_t **damage);
+
+/** Forget the previous frame
+ *
+ * \param tracker The tile tracker.
+ *
+ * The next wth_tile_tracker_update() damages the whole frame, e.g.
+ * after creating a new buffer for it.
+ *
+ * \memberof wth_tile_tracker
+ */
+void
+wth_tile_tracker_reset(struct wth_tile_tracker *tracker);
+
+/** Limit the instruction sets used for conversions and hashing
+ *
+ * \param simd The most capable instruction set to use.
+ * \return The instruction set actually used, which is lower than simd
+ * when the CPU does not support it.
+ *
+ * By default the best instruction set the CPU supports is used. This
+ * is meant for testing and benchmarking.
+ */
+enum wth_pixel_simd
+wth_pixel_set_simd(enum wth_pixel_simd simd);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -29,26 +29,74 @@
 #define WALTHAM_PRIVATE_H
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include "waltham-object.h"
 #include "waltham-connection.h"
 #include "waltham-util.h"
+#include "message.h"
 
-void
-wth_debug(const char *fmt, ...) WTH_PRINTF(1, 2);
+extern int wth_log_threshold;
+
+int
+wth_log_init_level(void);
+
+static inline int
+wth_log_enabled(enum wth_log_level level)
+{
+	int threshold = wth_log_threshold;
+
+	if (threshold < 0)
+		threshold = wth_log_init_level();
+
+	return (int) level <= threshold;
+}
 
 void
-wth_error(const char *fmt, ...) WTH_PRINTF(1, 2);
+wth_log(enum wth_log_level level, const char *fmt, ...) WTH_PRINTF(2, 3);
+
+/* The arguments are only evaluated when the level is enabled */
+#define wth_debug(...)							\
+	do {								\
+		if (wth_log_enabled(WTH_LOG_LEVEL_DEBUG))		\
+			wth_log(WTH_LOG_LEVEL_DEBUG, __VA_ARGS__);	\
+	} while (0)
+
+#define wth_error(...) wth_log(WTH_LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/* Per-message logging, compiled out with --disable-message-logging */
+#ifdef WTH_ENABLE_MESSAGE_LOGGING
+#define wth_trace(...)							\
+	do {								\
+		if (wth_log_enabled(WTH_LOG_LEVEL_TRACE))		\
+			wth_log(WTH_LOG_LEVEL_TRACE, __VA_ARGS__);	\
+	} while (0)
+#else
+#define wth_trace(...) do { } while (0)
+#endif
 
 void
 wth_abort(const char *fmt, ...) WTH_PRINTF(1, 2);
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* wth_display version implemented, see data/private.xml */
+#define WTH_DISPLAY_VERSION 4
+
 #define WTH_SERVER_ID_START 0xff000000
 
+/* Objects with their user state come from per-connection slabs of
+ * WTH_OBJECT_SLAB_CHUNK bytes, in blocks of multiples of
+ * WTH_OBJECT_SLAB_STEP bytes up to WTH_OBJECT_SLAB_CLASSES steps.
+ * Larger ones are allocated on their own. */
+#define WTH_OBJECT_SLAB_STEP 16
+#define WTH_OBJECT_SLAB_CLASSES 32
+#define WTH_OBJECT_SLAB_CHUNK 4096
+
 /* Flags for wth_map_insert_new and wth_map_insert_at.  Flags can be queried with
  * wth_map_lookup_flags.  The current implementation has room for 1 bit worth of
  * flags.  If more flags are ever added, the implementation of wth_map will have
@@ -99,10 +147,21 @@ void
 wth_connection_insert_new_object(struct wth_connection *conn,
     struct wth_object *obj);
 
-void
+int
 wth_connection_insert_object_with_id(struct wth_connection *conn,
     struct wth_object *obj);
 
+/* A new_id argument could not be created, because the ID was invalid or
+ * in use, or for lack of memory (errno ENOMEM) */
+void
+wth_connection_reject_new_id(struct wth_connection *conn, uint32_t id);
+
+/* A message added in a later interface version than the receiving
+ * object's implementation or listener handles */
+void
+wth_connection_reject_message(struct wth_connection *conn,
+    struct wth_object *obj, const char *name);
+
 void
 wth_connection_remove_object(struct wth_connection *conn,
     struct wth_object *obj);
@@ -110,6 +169,55 @@ wth_connection_remove_object(struct wth_connection *conn,
 struct wth_object *
 wth_connection_get_object(struct wth_connection *conn, uint32_t id);
 
+size_t
+wth_connection_get_object_user_size(struct wth_connection *conn);
+
+/* An object of the connection has a destroy hook */
+void
+wth_connection_use_destroy_hooks(struct wth_connection *conn);
+
+/* A zeroed block of at least size bytes for an object, and its user
+ * state, that lives at most as long as the connection */
+struct wth_object *
+wth_connection_alloc_object(struct wth_connection *conn, size_t size);
+
+void
+wth_connection_free_object(struct wth_connection *conn,
+    struct wth_object *obj);
+
+uint8_t *
+wth_connection_reserve_message(struct wth_connection *conn, size_t size,
+    size_t total_size, enum message_priority priority);
+
+void
+wth_connection_commit_message(struct wth_connection *conn, size_t size,
+    size_t total_size, enum message_priority priority);
+
+void
+wth_connection_commit_coalescible(struct wth_connection *conn, size_t size,
+    size_t total_size, enum message_priority priority, uint32_t key);
+
+size_t
+wth_connection_external_size(struct wth_connection *conn, size_t size);
+
+/* Send data from outside the output buffer at offset into the message
+ * being reserved. Returns true if it went on the side channel, which
+ * takes its padding along: the caller leaves that out as well. */
+bool
+wth_connection_add_external(struct wth_connection *conn,
+    enum message_priority priority, size_t total_size,
+    size_t offset, const void *data, size_t size);
+
+/* Send a duplicate of fd along with the message being reserved */
+void
+wth_connection_add_fd(struct wth_connection *conn,
+    enum message_priority priority, size_t total_size, int fd);
+
+/* The next received fd, owned by the caller. Sets the connection to
+ * EPROTO and returns -1 if none arrived. */
+int
+wth_connection_take_fd(struct wth_connection *conn);
+
 void
 wth_connection_assert_side(struct wth_connection *conn,
 			   const char *func,
@@ -127,16 +235,21 @@ wth_connection_assert_side(struct wth_connection *conn,
 struct wth_object {
 	struct wth_connection *connection;
 	uint32_t id;
+	bool id_deleted; /* the server has acknowledged the ID deletion */
+	bool has_user_state;
+	uint16_t slab_class; /* of its block, 0 when allocated on its own */
 
 	void (**vfunc)(void);
 	void *user_data;
+	wth_object_destroy_func destroy_hook;
 };
 
 /** Create a protocol object with given ID
  *
  * \param connection The Waltham connection.
  * \param id The object ID to reserve.
- * \return A new protocol object proxy with the given ID.
+ * \return A new protocol object proxy with the given ID, or NULL if the
+ * ID is not free to be taken by the peer.
  *
  * \memberof wth_object
  * \private
@@ -157,6 +270,24 @@ wth_object_new_with_id(struct wth_connection *connection, uint32_t id);
 struct wth_object *
 wth_object_new(struct wth_connection *connection);
 
+/** Create a protocol object with room for user state
+ *
+ * \param connection The Waltham connection.
+ * \param id The object ID to reserve, or 0 to allocate one.
+ * \param user_size Bytes of zeroed user state to allocate with the
+ * object, see wth_object_get_user_state().
+ * \return A new protocol object proxy.
+ *
+ * wth_object_new() and wth_object_new_with_id() use the size set with
+ * wth_connection_set_object_user_size().
+ *
+ * \memberof wth_object
+ * \private
+ */
+struct wth_object *
+wth_object_new_with_user_size(struct wth_connection *connection, uint32_t id,
+			      size_t user_size);
+
 /** Send an error on a specific object
  *
  * \param conn The Waltham connection.
@@ -35,43 +35,89 @@
 #include "waltham-private.h"
 
 static void
-wth_pfx_print(const char *pfx, const char *fmt, va_list argp)
+wth_default_log_handler(enum wth_log_level level, const char *fmt,
+			va_list argp)
 {
+	static const char *const pfx[] = {
+		[WTH_LOG_LEVEL_ERROR] = "Error",
+		[WTH_LOG_LEVEL_DEBUG] = "debug",
+		[WTH_LOG_LEVEL_TRACE] = "trace",
+	};
 	char msg[512];
 
 	vsnprintf(msg, sizeof msg, fmt, argp);
 
-	fprintf(stderr, "%s: %s\n", pfx, msg);
+	fprintf(stderr, "%s: %s\n", pfx[level], msg);
 }
 
-void
-wth_debug(const char *fmt, ...)
+static wth_log_func_t wth_log_handler = wth_default_log_handler;
+
+/* -1 until WALTHAM_DEBUG has been read */
+int wth_log_threshold = -1;
+
+int
+wth_log_init_level(void)
 {
-	va_list argp;
+	const char *env;
+	int level = WTH_LOG_LEVEL_ERROR;
+
+	env = getenv("WALTHAM_DEBUG");
+	if (env) {
+		level = atoi(env);
+		if (level < WTH_LOG_LEVEL_ERROR)
+			level = WTH_LOG_LEVEL_ERROR;
+		if (level > WTH_LOG_LEVEL_TRACE)
+			level = WTH_LOG_LEVEL_TRACE;
+	}
 
-	va_start(argp, fmt);
-	wth_pfx_print("debug", fmt, argp);
-	va_end(argp);
+	wth_log_threshold = level;
+
+	return level;
 }
 
 void
-wth_error(const char *fmt, ...)
+wth_log(enum wth_log_level level, const char *fmt, ...)
 {
 	va_list argp;
 
 	va_start(argp, fmt);
-	wth_pfx_print("Error", fmt, argp);
+	wth_log_handler(level, fmt, argp);
 	va_end(argp);
 }
 
+WTH_EXPORT void
+wth_set_log_handler(wth_log_func_t handler)
+{
+	wth_log_handler = handler ? handler : wth_default_log_handler;
+}
+
+WTH_EXPORT void
+wth_set_log_level(enum wth_log_level level)
+{
+	wth_log_threshold = level;
+}
+
+WTH_EXPORT enum wth_log_level
+wth_get_log_level(void)
+{
+	if (wth_log_threshold < 0)
+		return wth_log_init_level();
+
+	return wth_log_threshold;
+}
+
 void
 wth_abort(const char *fmt, ...)
 {
 	va_list argp;
+	char msg[512];
 
 	va_start(argp, fmt);
-	wth_pfx_print("Fatal", fmt, argp);
+	vsnprintf(msg, sizeof msg, fmt, argp);
 	va_end(argp);
+
+	/* Keep the prefix through custom log handlers as well */
+	wth_log(WTH_LOG_LEVEL_ERROR, "Fatal: %s", msg);
 	abort();
 }
 
@@ -259,6 +305,7 @@ WTH_EXPORT void
 wth_map_remove(struct wth_map *map, uint32_t i)
 {
 	union map_entry *start;
+	uint32_t count;
 	struct wth_array *entries;
 
 	if (i < WTH_SERVER_ID_START) {
@@ -275,6 +322,12 @@ wth_map_remove(struct wth_map *map, uint32_t i)
 	}
 
 	start = entries->data;
+	count = entries->size / sizeof *start;
+
+	/* An entry must not end up in the free list twice */
+	if (i >= count || map_entry_is_free(start[i]))
+		return;
+
 	start[i].next = map->free_list;
 	map->free_list = (i << 1) | 1;
 }
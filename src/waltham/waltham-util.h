@@ -135,6 +135,60 @@ enum wth_iterator_result {
 	WTH_ITERATOR_CONTINUE
 };
 
+/** \enum wth_log_level
+ *
+ * Severity of a log message. A message is passed to the log handler
+ * when its level is at or below the current log level.
+ */
+enum wth_log_level {
+	/** Errors, always logged */
+	WTH_LOG_LEVEL_ERROR = 0,
+	/** Connection and object life-cycle events */
+	WTH_LOG_LEVEL_DEBUG = 1,
+	/** Every message sent and received */
+	WTH_LOG_LEVEL_TRACE = 2
+};
+
+/** Log handler function type
+ *
+ * \param level The severity of the message.
+ * \param fmt A printf-style format string, without a trailing newline.
+ * \param args The arguments for fmt.
+ */
+typedef void (*wth_log_func_t)(enum wth_log_level level,
+			       const char *fmt, va_list args) WTH_PRINTF(2, 0);
+
+/** Set the function that receives log messages
+ *
+ * \param handler The new log handler, or NULL to restore the default
+ * handler which prints to stderr.
+ *
+ * The handler is global to the library and is only called for messages
+ * enabled by the current log level, see wth_set_log_level().
+ */
+void
+wth_set_log_handler(wth_log_func_t handler);
+
+/** Set the current log level
+ *
+ * \param level The most verbose level passed to the log handler.
+ *
+ * The default level is taken from the WALTHAM_DEBUG environment
+ * variable: unset or 0 logs errors only, 1 adds debug messages and 2
+ * also traces every message sent and received. Tracing is only
+ * available when Waltham was not configured with
+ * --disable-message-logging.
+ */
+void
+wth_set_log_level(enum wth_log_level level);
+
+/** Get the current log level
+ *
+ * \return The current log level.
+ */
+enum wth_log_level
+wth_get_log_level(void);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -78,6 +78,9 @@ fiddle_with_region(struct display *dpy)
 {
 	struct wthp_region *region;
 
+	/* Send the whole region life cycle in one go. */
+	wth_connection_cork(dpy->connection);
+
 	region = wthp_compositor_create_region(dpy->compositor);
 
 	wthp_region_add(region, 2, 2, 10, 10);
@@ -85,6 +88,9 @@ fiddle_with_region(struct display *dpy)
 	wthp_region_subtract(region, 50, 50, 5, 5);
 
 	wthp_region_destroy(region);
+
+	/* Whatever the socket did not take is flushed from mainloop(). */
+	wth_connection_uncork(dpy->connection);
 }
 
 /* The server advertises a global interface.
@@ -0,0 +1,287 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Sends a sequence of frames through wthp_blob_factory, once as full
+ * frames with create_buffer and once as the changes a wth_tile_tracker
+ * finds, sent with update_buffer. The frames are mostly static with a
+ * small square moving across them, and an unchanged frame every now
+ * and then. Also compares hashing a frame against copying it.
+ *
+ * The receiving end only drains the socket, no server is needed.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <waltham-object.h>
+#include <waltham-client.h>
+#include <waltham-connection.h>
+#include <waltham-pixel.h>
+
+#include "w-util.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define STRIDE (WIDTH * 4)
+#define FORMAT WTH_PIXEL_FORMAT_XRGB8888
+#define FRAMES 200
+#define SQUARE 96
+
+static const char *simd_names[] = { "c", "sse2", "avx2" };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+drain(int fd)
+{
+	char buf[65536];
+
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+	exit(0);
+}
+
+static void
+flush(struct wth_connection *conn)
+{
+	struct pollfd pfd;
+
+	pfd.fd = wth_connection_get_fd(conn);
+	pfd.events = POLLOUT;
+
+	while (wth_connection_flush(conn) < 0) {
+		if (errno != EAGAIN) {
+			fprintf(stderr, "flush failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		poll(&pfd, 1, -1);
+	}
+}
+
+/* Draw frame n: a square moving over a gradient, every tenth frame
+ * repeating the previous one. */
+static void
+draw_frame(uint32_t *pixels, int n)
+{
+	static int x, y;
+	int i, j;
+
+	if (n % 10 == 9)
+		return;
+
+	for (j = 0; j < SQUARE; j++)
+		for (i = 0; i < SQUARE; i++)
+			pixels[(y + j) * WIDTH + x + i] =
+				((y + j) << 8 | (x + i)) & 0xffffff;
+
+	x = (x + 37) % (WIDTH - SQUARE);
+	y = (y + 23) % (HEIGHT - SQUARE);
+
+	for (j = 0; j < SQUARE; j++)
+		for (i = 0; i < SQUARE; i++)
+			pixels[(y + j) * WIDTH + x + i] = 0xff8000 + n;
+}
+
+static void
+bench_full(struct wthp_blob_factory *factory, struct wth_connection *conn,
+	   uint32_t *pixels)
+{
+	struct wthp_buffer *buffer;
+	double start, elapsed;
+	int n;
+
+	start = now();
+	for (n = 0; n < FRAMES; n++) {
+		draw_frame(pixels, n);
+		buffer = wthp_blob_factory_create_buffer(factory,
+							 STRIDE * HEIGHT,
+							 pixels, WIDTH, HEIGHT,
+							 STRIDE, FORMAT);
+		wthp_buffer_destroy(buffer);
+		flush(conn);
+	}
+	elapsed = now() - start;
+
+	printf("full frames      %7.1f frames/s %9.1f MB sent\n",
+	       FRAMES / elapsed, (double) FRAMES * STRIDE * HEIGHT / 1e6);
+}
+
+static void
+bench_damage(struct wthp_blob_factory *factory, struct wth_connection *conn,
+	     uint32_t *pixels, uint8_t *scratch)
+{
+	struct wth_tile_tracker *tracker;
+	struct wthp_buffer *buffer;
+	struct wth_array damage;
+	const int32_t *rects;
+	double start, elapsed;
+	size_t size, sent = 0;
+	int n, count, skipped = 0;
+
+	tracker = wth_tile_tracker_create(WIDTH, HEIGHT, FORMAT, 0);
+	buffer = NULL;
+
+	start = now();
+	for (n = 0; n < FRAMES; n++) {
+		draw_frame(pixels, n);
+		count = wth_tile_tracker_update(tracker, pixels, STRIDE,
+						&rects);
+		if (count == 0) {
+			skipped++;
+			continue;
+		}
+
+		if (!buffer) {
+			buffer = wthp_blob_factory_create_buffer(factory,
+								 STRIDE * HEIGHT,
+								 pixels, WIDTH,
+								 HEIGHT, STRIDE,
+								 FORMAT);
+			sent += STRIDE * HEIGHT;
+		} else {
+			size = wth_pixel_copy_rects(scratch, pixels, STRIDE,
+						    FORMAT, rects, count);
+			damage.size = damage.alloc = count * 4 * sizeof *rects;
+			damage.data = (void *) rects;
+			wthp_blob_factory_update_buffer(factory, buffer,
+							&damage, size,
+							scratch);
+			sent += size;
+		}
+		flush(conn);
+	}
+	elapsed = now() - start;
+
+	printf("tracked changes  %7.1f frames/s %9.1f MB sent, "
+	       "%d frames skipped\n",
+	       FRAMES / elapsed, sent / 1e6, skipped);
+
+	wthp_buffer_destroy(buffer);
+	flush(conn);
+	wth_tile_tracker_destroy(tracker);
+}
+
+/* Hashing has to beat the copy it saves */
+static void
+bench_hash(uint32_t *pixels, uint8_t *scratch)
+{
+	struct wth_tile_tracker *tracker;
+	const int32_t *rects;
+	enum wth_pixel_simd simd;
+	double start, elapsed;
+	int n;
+
+	start = now();
+	for (n = 0; n < FRAMES; n++)
+		memcpy(scratch, pixels, STRIDE * HEIGHT);
+	elapsed = now() - start;
+	printf("memcpy frame     %7.3f ms\n", elapsed * 1e3 / FRAMES);
+
+	for (simd = WTH_PIXEL_SIMD_NONE; simd <= WTH_PIXEL_SIMD_AVX2; simd++) {
+		if (wth_pixel_set_simd(simd) != simd)
+			continue;
+
+		tracker = wth_tile_tracker_create(WIDTH, HEIGHT, FORMAT, 0);
+		start = now();
+		for (n = 0; n < FRAMES; n++)
+			wth_tile_tracker_update(tracker, pixels, STRIDE,
+						&rects);
+		elapsed = now() - start;
+		printf("hash frame %-4s  %7.3f ms\n",
+		       simd_names[simd], elapsed * 1e3 / FRAMES);
+		wth_tile_tracker_destroy(tracker);
+	}
+
+	wth_pixel_set_simd(WTH_PIXEL_SIMD_AVX2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wth_connection *conn;
+	struct wthp_registry *registry;
+	struct wthp_blob_factory *factory;
+	uint32_t *pixels;
+	uint8_t *scratch;
+	int fds[2];
+	pid_t pid;
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		return 1;
+
+	pid = fork();
+	if (pid < 0)
+		return 1;
+	if (pid == 0) {
+		close(fds[0]);
+		drain(fds[1]);
+	}
+	close(fds[1]);
+
+	conn = wth_connection_from_fd(fds[0], WTH_CONNECTION_SIDE_CLIENT);
+	if (!conn)
+		return 1;
+
+	registry = wth_connection_create_registry(conn);
+	factory = (struct wthp_blob_factory *)
+		wthp_registry_bind(registry, 1, "wthp_blob_factory", 2);
+
+	pixels = malloc(STRIDE * HEIGHT);
+	scratch = malloc(STRIDE * HEIGHT);
+	if (!pixels || !scratch)
+		return 1;
+
+	for (i = 0; i < WIDTH * HEIGHT; i++)
+		pixels[i] = (i / WIDTH) << 8 | (i % WIDTH & 0xff);
+
+	bench_hash(pixels, scratch);
+	bench_full(factory, conn, pixels);
+	bench_damage(factory, conn, pixels, scratch);
+
+	wthp_blob_factory_free(factory);
+	wthp_registry_free(registry);
+	wth_connection_destroy(conn);
+	waitpid(pid, NULL, 0);
+
+	free(pixels);
+	free(scratch);
+
+	return 0;
+}
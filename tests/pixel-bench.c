@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures the pixel format conversions with each instruction set on
+ * full HD frames, and checks that they all agree with the plain C
+ * conversion.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <waltham-pixel.h>
+
+#include "w-util.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ROUNDS 50
+
+static const struct {
+	const char *name;
+	uint32_t format;
+} formats[] = {
+	{ "argb8888", WTH_PIXEL_FORMAT_ARGB8888 },
+	{ "xrgb8888", WTH_PIXEL_FORMAT_XRGB8888 },
+	{ "rgb565", WTH_PIXEL_FORMAT_RGB565 },
+	{ "xrgb4444", WTH_PIXEL_FORMAT_XRGB4444 },
+	{ "argb4444", WTH_PIXEL_FORMAT_ARGB4444 },
+	{ "xrgb1555", WTH_PIXEL_FORMAT_XRGB1555 },
+	{ "argb1555", WTH_PIXEL_FORMAT_ARGB1555 },
+};
+
+static const char *simd_names[] = { "c", "sse2", "avx2" };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench(uint32_t dst_format, uint32_t src_format, const char *dst_name,
+      const char *src_name, const void *src, void *dst, void *ref)
+{
+	int src_stride = WIDTH * wth_pixel_format_get_bpp(src_format);
+	int dst_stride = WIDTH * wth_pixel_format_get_bpp(dst_format);
+	enum wth_pixel_simd simd, used;
+	double start, elapsed;
+	int i, ret = 0;
+
+	for (simd = WTH_PIXEL_SIMD_NONE; simd <= WTH_PIXEL_SIMD_AVX2; simd++) {
+		used = wth_pixel_set_simd(simd);
+		if (used != simd)
+			continue;
+
+		wth_pixel_convert(dst, dst_format, dst_stride,
+				  src, src_format, src_stride,
+				  WIDTH, HEIGHT);
+		if (simd == WTH_PIXEL_SIMD_NONE) {
+			memcpy(ref, dst, (size_t) dst_stride * HEIGHT);
+		} else if (memcmp(ref, dst, (size_t) dst_stride * HEIGHT)) {
+			fprintf(stderr, "%s -> %s: %s differs from c\n",
+				src_name, dst_name, simd_names[simd]);
+			ret = -1;
+		}
+
+		start = now();
+		for (i = 0; i < ROUNDS; i++)
+			wth_pixel_convert(dst, dst_format, dst_stride,
+					  src, src_format, src_stride,
+					  WIDTH, HEIGHT);
+		elapsed = now() - start;
+
+		printf("%-8s -> %-8s %-4s %8.1f Mpixels/s\n",
+		       src_name, dst_name, simd_names[simd],
+		       (double) WIDTH * HEIGHT * ROUNDS / elapsed / 1e6);
+	}
+
+	return ret;
+}
+
+/* Sources without alpha have to come out opaque */
+static int
+check_opaque(const uint16_t *dst, uint16_t alpha, const char *name)
+{
+	int i;
+
+	for (i = 0; i < WIDTH * HEIGHT; i++) {
+		if ((dst[i] & alpha) != alpha) {
+			fprintf(stderr, "xrgb8888 -> %s: pixel %d is not "
+				"opaque\n", name, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t *src32, *dst32, *ref;
+	uint16_t *src16;
+	unsigned i;
+	int ret = 0;
+
+	src32 = malloc(WIDTH * HEIGHT * 4);
+	dst32 = malloc(WIDTH * HEIGHT * 4);
+	ref = malloc(WIDTH * HEIGHT * 4);
+	src16 = malloc(WIDTH * HEIGHT * 2);
+	if (!src32 || !dst32 || !ref || !src16)
+		return 1;
+
+	srand(1);
+	for (i = 0; i < WIDTH * HEIGHT; i++) {
+		src32[i] = (uint32_t) rand() << 16 ^ rand();
+		src16[i] = rand();
+	}
+
+	/* Sending: the rendered format to each cheaper one */
+	for (i = 2; i < ARRAY_LENGTH(formats); i++)
+		ret |= bench(formats[i].format, formats[0].format,
+			     formats[i].name, formats[0].name,
+			     src32, dst32, ref);
+
+	/* Rendered without alpha, to the formats with alpha */
+	ret |= bench(formats[4].format, formats[1].format,
+		     formats[4].name, formats[1].name, src32, dst32, ref);
+	ret |= check_opaque((const uint16_t *) dst32, 0xf000,
+			    formats[4].name);
+	ret |= bench(formats[6].format, formats[1].format,
+		     formats[6].name, formats[1].name, src32, dst32, ref);
+	ret |= check_opaque((const uint16_t *) dst32, 0x8000,
+			    formats[6].name);
+
+	/* Receiving: back to the format to draw with */
+	for (i = 2; i < ARRAY_LENGTH(formats); i++)
+		ret |= bench(formats[0].format, formats[i].format,
+			     formats[0].name, formats[i].name,
+			     src16, dst32, ref);
+
+	ret |= bench(formats[0].format, formats[1].format,
+		     formats[0].name, formats[1].name, src32, dst32, ref);
+
+	free(src32);
+	free(dst32);
+	free(ref);
+	free(src16);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2026 The Waltham Contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures how fast a connection parses and dispatches received
+ * messages, with message sizes that make them straddle the end of the
+ * receive ring buffer every now and then.
+ *
+ * A server-side connection generates wthp_registry.global events with
+ * strings of varying length once; the stream is captured and a child
+ * process writes it over and over to the client-side connection that is
+ * measured. The flood workload uses wthp_registry.global_remove events
+ * instead, which are about as small as pointer motion events.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <waltham-object.h>
+#include <waltham-client.h>
+#include <waltham-connection.h>
+
+#include "w-util.h"
+
+/* Copied from waltham-server.h, which can't be included together with
+ * waltham-client.h */
+void
+wthp_registry_send_global (struct wthp_registry * wthp_registry, uint32_t name, const char * interface, uint32_t version);
+void
+wthp_registry_send_global_remove (struct wthp_registry * wthp_registry, uint32_t name);
+
+#define STREAM_SIZE (8 * 1024 * 1024)
+#define REPEAT 32
+
+struct workload {
+	const char *name;
+	int min_len;
+	int max_len; /* 0 for global_remove events */
+};
+
+static const struct workload workloads[] = {
+	{ "flood", 0, 0 },
+	{ "small", 1, 64 },
+	{ "mixed", 1, 4096 },
+	{ "large", 16384, 60000 },
+};
+
+static struct wthp_registry *server_registry;
+static uint64_t received;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+registry_handle_global(struct wthp_registry *registry, uint32_t name,
+		       const char *interface, uint32_t version)
+{
+	received++;
+}
+
+static void
+registry_handle_global_remove(struct wthp_registry *registry, uint32_t name)
+{
+	received++;
+}
+
+static const struct wthp_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove
+};
+
+static void
+registry_created(struct wthp_registry *registry, void *user_data)
+{
+	server_registry = registry;
+}
+
+/* Move what is readable from one fd to another */
+static size_t
+relay(int from, uint8_t *buf, size_t size, int to)
+{
+	ssize_t n, len = 0;
+
+	do {
+		n = read(from, buf + len, size - len);
+		if (n > 0)
+			len += n;
+	} while (n > 0 && (size_t) len < size);
+
+	if (to >= 0 && len > 0 && write(to, buf, len) != len)
+		exit(1);
+
+	return len;
+}
+
+/* Events for the client's registry, as the server sends them */
+static uint8_t *
+capture_stream(struct wth_connection *server, int server_peer,
+	       const struct workload *w, size_t *size, int *count)
+{
+	uint8_t *buf;
+	char *name;
+	size_t len = 0;
+	int n = 0;
+
+	buf = malloc(STREAM_SIZE + 1024 * 1024);
+	name = malloc(w->max_len + 1);
+	if (!buf || !name)
+		exit(1);
+
+	while (len < STREAM_SIZE) {
+		if (w->max_len == 0) {
+			wthp_registry_send_global_remove(server_registry, n);
+		} else {
+			int l = w->min_len +
+				(n * 7919) % (w->max_len - w->min_len + 1);
+
+			memset(name, 'a' + n % 26, l);
+			name[l] = '\0';
+			wthp_registry_send_global(server_registry, n, name, 1);
+		}
+		n++;
+
+		while (wth_connection_flush(server) < 0) {
+			if (errno != EAGAIN)
+				exit(1);
+			len += relay(server_peer, buf + len,
+				     STREAM_SIZE + 1024 * 1024 - len, -1);
+		}
+		len += relay(server_peer, buf + len,
+			     STREAM_SIZE + 1024 * 1024 - len, -1);
+	}
+
+	free(name);
+	*size = len;
+	*count = n;
+
+	return buf;
+}
+
+static void
+bench(struct wth_connection *client, int client_peer,
+      struct wth_connection *server, int server_peer,
+      const struct workload *w)
+{
+	struct pollfd pfd;
+	uint8_t *stream;
+	size_t size;
+	double start, elapsed;
+	int count, i;
+	pid_t pid;
+
+	stream = capture_stream(server, server_peer, w, &size, &count);
+	received = 0;
+
+	pid = fork();
+	if (pid < 0)
+		exit(1);
+	if (pid == 0) {
+		fcntl(client_peer, F_SETFL, 0);
+		for (i = 0; i < REPEAT; i++)
+			if (write(client_peer, stream, size) != (ssize_t) size)
+				_exit(1);
+		_exit(0);
+	}
+
+	pfd.fd = wth_connection_get_fd(client);
+	pfd.events = POLLIN;
+
+	start = now();
+	while (received < (uint64_t) count * REPEAT) {
+		if (poll(&pfd, 1, -1) < 0)
+			exit(1);
+		if (wth_connection_read(client) < 0 && errno != EAGAIN) {
+			fprintf(stderr, "read failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		wth_connection_dispatch(client);
+	}
+	elapsed = now() - start;
+
+	printf("%-6s %6.0f bytes/message %9.0f messages/s %8.1f MB/s\n",
+	       w->name, (double) size / count, count * REPEAT / elapsed,
+	       size * REPEAT / elapsed / 1e6);
+
+	waitpid(pid, NULL, 0);
+	free(stream);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wth_connection *client, *server;
+	struct wthp_registry *registry;
+	uint8_t buf[4096];
+	int client_fds[2], server_fds[2];
+	unsigned i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+		       client_fds) < 0 ||
+	    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+		       server_fds) < 0)
+		return 1;
+
+	fcntl(client_fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(server_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(server_fds[1], F_SETFL, O_NONBLOCK);
+
+	client = wth_connection_from_fd(client_fds[0],
+					WTH_CONNECTION_SIDE_CLIENT);
+	server = wth_connection_from_fd(server_fds[1],
+					WTH_CONNECTION_SIDE_SERVER);
+	if (!client || !server)
+		return 1;
+
+	wth_connection_set_registry_callback(server, registry_created, NULL);
+
+	/* Set up the registry on both sides, by hand */
+	registry = wth_connection_create_registry(client);
+	wthp_registry_set_listener(registry, &registry_listener, NULL);
+	wth_connection_flush(client);
+	relay(client_fds[1], buf, sizeof buf, server_fds[0]);
+	wth_connection_read(server);
+	wth_connection_dispatch(server);
+	if (!server_registry)
+		return 1;
+
+	/* wth_display.server_version */
+	wth_connection_flush(server);
+	relay(server_fds[0], buf, sizeof buf, client_fds[1]);
+
+	for (i = 0; i < ARRAY_LENGTH(workloads); i++)
+		bench(client, client_fds[1], server, server_fds[0],
+		      &workloads[i]);
+
+	wthp_registry_free(registry);
+	wth_connection_destroy(client);
+	wth_connection_destroy(server);
+
+	return 0;
+}
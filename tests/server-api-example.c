@@ -56,34 +56,28 @@ struct watch {
 struct region {
 	struct wthp_region *obj;
 	/* pixman_region32_t region; */
-	struct wl_list link; /* struct client::region_list */
 };
 
 /* wthp_compositor protocol object */
 struct compositor {
 	struct wthp_compositor *obj;
 	struct client *client;
-	struct wl_list link; /* struct client::compositor_list */
 };
 
 /* wthp_registry protocol object */
 struct registry {
 	struct wthp_registry *obj;
 	struct client *client;
-	struct wl_list link; /* struct client::registry_list */
 };
 
+/* Client objects have destroy hooks that clean them up on
+ * disconnection, so the client needs no object lists. */
 struct client {
 	struct wl_list link; /* struct server::client_list */
 	struct server *server;
 
 	struct wth_connection *connection;
 	struct watch conn_watch;
-
-	/* client object lists for clean-up on disconnection */
-	struct wl_list registry_list;   /* struct registry::link */
-	struct wl_list compositor_list; /* struct compositor::link */
-	struct wl_list region_list;     /* struct region::link */
 };
 
 struct server {
@@ -114,10 +108,15 @@ region_destroy(struct region *region)
 	fprintf(stderr, "region %p destroy\n", region->obj);
 
 	wthp_region_free(region->obj);
-	wl_list_remove(&region->link);
 	free(region);
 }
 
+static void
+region_teardown(struct wth_object *obj)
+{
+	region_destroy(wth_object_get_user_data(obj));
+}
+
 static void
 region_handle_destroy(struct wthp_region *wthp_region)
 {
@@ -161,10 +160,15 @@ compositor_destroy(struct compositor *comp)
 	fprintf(stderr, "%s: %p\n", __func__, comp->obj);
 
 	wthp_compositor_free(comp->obj);
-	wl_list_remove(&comp->link);
 	free(comp);
 }
 
+static void
+compositor_teardown(struct wth_object *obj)
+{
+	compositor_destroy(wth_object_get_user_data(obj));
+}
+
 static void
 compositor_handle_create_surface(struct wthp_compositor *compositor,
 				 struct wthp_surface *id)
@@ -190,9 +194,9 @@ compositor_handle_create_region(struct wthp_compositor *compositor,
 	}
 
 	region->obj = id;
-	wl_list_insert(&comp->client->region_list, &region->link);
 
 	wthp_region_set_interface(id, &region_implementation, region);
+	wth_object_set_destroy_hook((struct wth_object *)id, region_teardown);
 }
 
 static const struct wthp_compositor_interface compositor_implementation = {
@@ -214,10 +218,11 @@ client_bind_compositor(struct client *c, struct wthp_compositor *obj)
 
 	comp->obj = obj;
 	comp->client = c;
-	wl_list_insert(&c->compositor_list, &comp->link);
 
 	wthp_compositor_set_interface(obj, &compositor_implementation,
 				      comp);
+	wth_object_set_destroy_hook((struct wth_object *)obj,
+				    compositor_teardown);
 	fprintf(stderr, "client %p bound wthp_compositor\n", c);
 }
 
@@ -231,10 +236,15 @@ registry_destroy(struct registry *reg)
 	fprintf(stderr, "%s: %p\n", __func__, reg->obj);
 
 	wthp_registry_free(reg->obj);
-	wl_list_remove(&reg->link);
 	free(reg);
 }
 
+static void
+registry_teardown(struct wth_object *obj)
+{
+	registry_destroy(wth_object_get_user_data(obj));
+}
+
 static void
 registry_handle_destroy(struct wthp_registry *registry)
 {
@@ -287,9 +297,10 @@ display_handle_get_registry(struct wthp_registry *registry,
 
 	reg->obj = registry;
 	reg->client = c;
-	wl_list_insert(&c->registry_list, &reg->link);
 	wthp_registry_set_interface(registry,
 	                            &registry_implementation, reg);
+	wth_object_set_destroy_hook((struct wth_object *)registry,
+				    registry_teardown);
 
 	/* XXX: advertise our globals */
 	wthp_registry_send_global(registry, 1, "wthp_compositor", 4);
@@ -298,26 +309,12 @@ display_handle_get_registry(struct wthp_registry *registry,
 static void
 client_destroy(struct client *c)
 {
-	struct region *region;
-	struct compositor *comp;
-	struct registry *reg;
-
 	fprintf(stderr, "Client %p disconnected.\n", c);
 
-	/* clean up remaining client resources in case the client
-	 * did not.
-	 */
-	wl_list_last_until_empty(region, &c->region_list, link)
-		region_destroy(region);
-
-	wl_list_last_until_empty(comp, &c->compositor_list, link)
-		compositor_destroy(comp);
-
-	wl_list_last_until_empty(reg, &c->registry_list, link)
-		registry_destroy(reg);
-
 	wl_list_remove(&c->link);
 	watch_ctl(&c->conn_watch, EPOLL_CTL_DEL, 0);
+
+	/* The destroy hooks clean up what the client did not */
 	wth_connection_destroy(c->connection);
 	free(c);
 }
@@ -397,10 +394,6 @@ client_create(struct server *srv, struct wth_connection *conn)
 
 	wl_list_insert(&srv->client_list, &c->link);
 
-	wl_list_init(&c->registry_list);
-	wl_list_init(&c->compositor_list);
-	wl_list_init(&c->region_list);
-
 	wth_connection_set_registry_callback(conn, display_handle_get_registry, c);
 
 	return c;
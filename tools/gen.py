@@ -40,6 +40,16 @@ freefunc_interface = ''
 funcdef = dict()
 opcode = '0'
 
+# Opcodes are global and follow document order. Messages marked
+# appended="true" are numbered after all the others instead, so that
+# adding them does not renumber the messages older peers know. Messages
+# added to an input file that comes before others take a fixed
+# opcode="N" for the same reason, which appended numbering skips.
+base_opcodes = 0
+next_opcode = 0
+next_late_opcode = 0
+fixed_opcodes = set()
+
 demarshaller_generated_funcs = dict()
 
 max_opcode = 0
@@ -57,8 +67,12 @@ native_types = {
   "string":   "const char *",
   "array":    "struct wth_array *",
   "data":     "void *",
+  "fd":       "int32_t",
 }
 
+# scheduling classes of outgoing messages, see enum message_priority
+priorities = ("input", "control", "bulk")
+
 type_formats = {
   "int32_t":           "%d",
   "uint32_t":          "%u",
@@ -123,8 +137,18 @@ def marshaller_generator(funcdef, opcode):
         if funcdef.get('rettype') in type_formats:
             fmt_ret = '"' + type_formats.get(funcdef.get('rettype')) + ' ", ret'
 
+    # messages without strings, arrays or data have a size known at compile
+    # time, and are encoded with plain stores only
+    fixed_size = True
+    for params in funcdef.get('params'):
+        if params.get('is_string') or params.get('is_data') or params.get('is_array'):
+            fixed_size = False
+
     # sz local variable
-    outstr += '   int sz = sizeof(hdr_t)'
+    if fixed_size:
+        outstr += '   const int sz = sizeof(hdr_t)'
+    else:
+        outstr += '   int sz = sizeof(hdr_t)'
     haveparams = 1
     paramitr = 0
     while haveparams:
@@ -135,8 +159,11 @@ def marshaller_generator(funcdef, opcode):
             if funcname + ':' + params.get('val') not in variable_size_attributes:
                 if params.get('object') or params.get('new_id'):
                     outstr += ' + PADDED(sizeof(uint32_t))'
-                elif params.get('is_string'):
-                    # Don't add anything here. It gets added later through variable_size_attributes
+                elif params.get('is_fd'):
+                    # passed beside the message
+                    pass
+                elif params.get('is_string') or params.get('is_array'):
+                    # Don't add anything here. It gets added later through var_attr_size
                     pass
                 elif params.get('is_data'):
                     outstr += ' + PADDED(' + params.get('val') + '_sz)'
@@ -150,8 +177,22 @@ def marshaller_generator(funcdef, opcode):
 
     outstr += '   START_TIMING("' + funcname + '", "' + fmt_string + '"' + fmt_params + ');\n'
 
+    conn = '((struct wth_object *){})->connection'.format(funcdef.get('param0').get('val'))
+
+    # data arguments may be sent from caller memory instead of being copied
+    external = []
+    for params in funcdef.get('params'):
+        if params.get('is_data'):
+            outstr += '   size_t {0}_external = DATA_EXTERNAL_SIZE({1}, {0}_sz);\n'.format(params.get('val'), conn)
+            external.append(params.get('val') + '_external')
+
+    priority = 'MESSAGE_PRIORITY_' + funcdef.get('priority').upper()
+
     # serialize message header
-    outstr += '   START_MESSAGE("{}", sz, {});\n'.format(funcname, opcode)
+    if external:
+        outstr += '   START_MESSAGE_EXTERNAL({}, "{}", sz, {}, {}, {});\n'.format(conn, funcname, ' + '.join(external), opcode, priority)
+    else:
+        outstr += '   START_MESSAGE({}, "{}", sz, {}, {});\n'.format(conn, funcname, opcode, priority)
 
     # serialize params
     haveparams = 1
@@ -174,26 +215,35 @@ def marshaller_generator(funcdef, opcode):
                     var_attr_size += '   sz += sizeof (unsigned int) + PADDED(' + params.get('val') + '_sz);\n'
 
                 # we use SERIALIZE_DATA instead of SERIALIZE_PARAM for variable-size params
-                outstr += '   SERIALIZE_DATA( (void *)' + params.get('val') + ', ' + params.get('val') + '_sz);\n'
+                if params.get('is_data'):
+                    outstr += '   SERIALIZE_DATA_EXTERNAL( {0}, (void *){1}, {1}_sz, {1}_external);\n'.format(conn, params.get('val'))
+                else:
+                    outstr += '   SERIALIZE_DATA( (void *)' + params.get('val') + ', ' + params.get('val') + '_sz);\n'
 
             else:
                 if params.get('is_array'):
+                    var_attr_size += '   sz += sizeof (unsigned int) + PADDED(' + params.get('val') + '->size);\n'
                     outstr += '   SERIALIZE_ARRAY( ' + params.get('val') + ' );\n'
                 else:
                     if params.get('new_id'):
-                        outstr += '   SERIALIZE_PARAM( (void *)&((struct wth_object *)ret)->id, sizeof(uint32_t) );\n'
+                        outstr += '   SERIALIZE_OBJECT( ret );\n'
                     elif params.get('object'):
-                        outstr += '   SERIALIZE_PARAM( (void *)&((struct wth_object *)' + params.get('val') + ')->id, sizeof(uint32_t) );\n'
+                        outstr += '   SERIALIZE_OBJECT( ' + params.get('val') + ' );\n'
                     elif params.get('is_counter'):
                         # Don't serialize the size here, it gets sent through SERIALIZE_DATA
                         pass
+                    elif params.get('is_fd'):
+                        outstr += '   SERIALIZE_FD( {}, {} );\n'.format(conn, params.get('val'))
                     else:
-                        outstr += '   SERIALIZE_PARAM( (void *)&' + params.get('val') + ', sizeof(' + params.get('val') + ') );\n'
+                        outstr += '   SERIALIZE_PARAM( ' + params.get('val') + ' );\n'
             paramitr += 1
         else:
             break
 
-    outstr += '   END_MESSAGE(((struct wth_object *){})->connection);\n'.format(funcdef.get('param0').get('val'))
+    if 'coalesce' in funcdef:
+        outstr += '   END_MESSAGE_COALESCE({}, {});\n'.format(conn, funcdef.get('coalesce'))
+    else:
+        outstr += '   END_MESSAGE(((struct wth_object *){})->connection);\n'.format(funcdef.get('param0').get('val'))
 
     if var_attr_size != "":
         outstr = outstr.replace('VAR_ATTR_SIZE', var_attr_size + '\n')
@@ -236,6 +286,8 @@ def demarshaller_generator(funcdef, opcode):
     params_call = ''
     fmt_string = ''
     fmt_params = ''
+    fds = []
+    new_ids = []
     while haveparams:
         searchstr = ('param' + str(paramitr))
         haveparams = searchstr in funcdef
@@ -253,6 +305,14 @@ def demarshaller_generator(funcdef, opcode):
                 params_call += params.get('val')
                 fmt_string += '[variable type ' + params.get('type') + ']'
 
+            elif params.get('is_fd'):
+                # not in the body, taken in order from the received ones
+                code += '  int32_t ' + params.get('val') + ' = wth_connection_take_fd (conn);\n'
+                fds.append(params.get('val'))
+                params_call += params.get('val')
+                fmt_string += '%d'
+                fmt_params += ', ' + params.get('val')
+
             elif var_id in variable_size_attributes or params.get('is_string') or params.get('is_array') or params.get('is_data'):
                 # variable size param, first comes the number of bytes and then the data
                 # size of the input parameter, needed to determine where the next parameter
@@ -276,7 +336,10 @@ def demarshaller_generator(funcdef, opcode):
                 type_ = params.get('type')
                 objtype = params.get('objtype')
 
-                code += '  ' + objtype + params.get('val') + ' = (' + objtype + ') wth_object_new_with_id (((struct wth_object *)' + funcdef.get('param0').get('val') + ')->connection, *(uint32_t *)(body' + offset_string + '));\n'
+                # created once the fds are taken, see below
+                code += '  uint32_t ' + params.get('val') + '_id = *(uint32_t *)(body' + offset_string + ');\n'
+                code += '  ' + objtype + params.get('val') + ';\n'
+                new_ids.append((params.get('val'), objtype))
                 offset_string += ' + PADDED (sizeof (' + type_ + '))'
                 params_call += params.get('val')
 
@@ -318,15 +381,56 @@ def demarshaller_generator(funcdef, opcode):
     if paramitr != 0:
         code += '\n'
 
-    code += '  wth_debug ("' + apifuncname + '(' + fmt_string + ') (opcode ' \
-            + str(opcode) + ') called."' + fmt_params + ');\n'
+    # The fds are taken first, so that every early return below can close
+    # them; each message owns its fds whether it is dispatched or not
+    if fds:
+        code += '  if (' + ' || '.join(fd + ' < 0' for fd in fds) + ')'
+        if len(fds) > 1:
+            code += ' {\n'
+            for fd in fds:
+                code += '    if (' + fd + ' >= 0)\n'
+                code += '      close (' + fd + ');\n'
+            code += '    return;\n'
+            code += '  }\n\n'
+        else:
+            code += '\n    return;\n\n'
 
     objname = funcdef['param0']['val']
     listener = 'struct {}_{} *'.format(objname, "listener" if mode == "client" else "interface")
     vfunc = funcdef['origname']
+    handlers = '((' + listener + ')(((struct wth_object *)' + objname + ')->vfunc))'
+
+    # Implementations written against an earlier version of the interface
+    # leave the handlers of later messages NULL
+    if funcdef['since'] > 1:
+        code += '  if (((struct wth_object *)' + objname + ')->vfunc == NULL ||\n'
+        code += '      ' + handlers + '->' + vfunc + ' == NULL) {\n'
+        code += '    wth_connection_reject_message (conn, (struct wth_object *) ' + objname + ', "' + apifuncname + '");\n'
+        for fd in fds:
+            code += '    close (' + fd + ');\n'
+        code += '    return;\n'
+        code += '  }\n\n'
+
+    # IDs the peer may not take, or no memory; nothing is dispatched after
+    # the protocol error this raises
+    created = []
+    for new_id, objtype in new_ids:
+        code += '  ' + new_id + ' = (' + objtype + ') wth_object_new_with_id (conn, ' + new_id + '_id);\n'
+        code += '  if (' + new_id + ' == NULL) {\n'
+        code += '    wth_connection_reject_new_id (conn, ' + new_id + '_id);\n'
+        for obj in created:
+            code += '    wth_object_delete ((struct wth_object *) ' + obj + ');\n'
+        for fd in fds:
+            code += '    close (' + fd + ');\n'
+        code += '    return;\n'
+        code += '  }\n\n'
+        created.append(new_id)
+
+    code += '  wth_trace ("' + apifuncname + '(' + fmt_string + ') (opcode ' \
+            + str(opcode) + ') called."' + fmt_params + ');\n'
 
     code += '  START_TIMING();\n'
-    code += '  ((' + listener + ')(((struct wth_object *)' + objname + ')->vfunc))->' + vfunc + '\n'
+    code += '  ' + handlers + '->' + vfunc + '\n'
     code += '    (' + params_call + ');\n'
     code += '  END_TIMING("' + apifuncname + '");\n'
     code += "}\n"
@@ -335,7 +439,7 @@ def demarshaller_generator(funcdef, opcode):
     return code
 
 
-def get_func_params(funcdef):
+def get_func_params(funcdef, receiving):
     outstr = ''
 
     outstr += '('
@@ -352,10 +456,11 @@ def get_func_params(funcdef):
         param = funcdef.get(searchstr)
         type_ = param.get('type')
         if param.get('new_id'):
-            if mode == "client":
+            # the sending side creates the object and returns it, the
+            # receiving side gets it as an argument
+            if not receiving:
                 continue
-            else:
-                type_ = param.get('objtype')
+            type_ = param.get('objtype')
 
         outstr += comma + type_ + ' ' + param.get('val')
         comma = ', '
@@ -375,7 +480,7 @@ def get_func_prototype(funcdef):
 
     # func name
     outstr += funcdef.get('name') + ' '
-    outstr += get_func_params(funcdef)
+    outstr += get_func_params(funcdef, False)
 
     return outstr
 
@@ -412,7 +517,7 @@ def header_generator(funcdef, type_):
             listener_interface = interface
             header_structs += "struct {}_{} {{\n".format(interface, "listener" if mode == "client" else "interface")
 
-        header_structs += "  void (*" + funcdef.get('origname') + ") " + get_func_params(funcdef) + ";\n"
+        header_structs += "  void (*" + funcdef.get('origname') + ") " + get_func_params(funcdef, True) + ";\n"
         return ""
 
     header_funcs += get_func_prototype(funcdef) + ';\n\n'
@@ -471,6 +576,11 @@ def add_new_argument(funcdef, attrs, new_param):
 
     if funcdef[entry]['type'] in native_types:
         funcdef[entry]['type'] = native_types[funcdef[entry]['type']]
+    if attrs.get('type') == "fd":
+        funcdef[entry]['is_fd'] = True
+        # only the main queue keeps fds in order with their messages
+        if funcdef['priority'] == 'input':
+            sys.exit('{}: fd arguments cannot have input priority'.format(funcdef['name']))
     if attrs.get('type') == "object":
         funcdef[entry]['object'] = True
         if attrs.get('interface'):
@@ -498,6 +608,8 @@ def start_element(elementname, attrs):
     global typegen
     global max_opcode
     global parameter_size
+    global next_opcode
+    global next_late_opcode
 
     if elementname == "request" or elementname == "event":
         # infunc indicates we are inside an xml block for a request/event
@@ -511,7 +623,24 @@ def start_element(elementname, attrs):
         funcdef['paramcnt'] = 0
         if attrs.get('type') == 'destructor':
             funcdef['destructor'] = True
-        opcode = str(int(opcode) + 1)
+        funcdef['since'] = int(attrs.get('since', '1'))
+        funcdef['priority'] = attrs.get('priority', 'control')
+        if funcdef['priority'] not in priorities:
+            sys.exit('{}: unknown priority "{}"'.format(funcdef['name'], funcdef['priority']))
+        # superseded by a later message with the same object, opcode and
+        # coalesce-key argument value
+        if attrs.get('coalesce') == 'true':
+            funcdef['coalesce'] = attrs.get('coalesce-key', '0')
+        if attrs.get('opcode') is not None:
+            opcode = attrs.get('opcode')
+        elif attrs.get('appended') == 'true':
+            next_late_opcode += 1
+            while base_opcodes + next_late_opcode in fixed_opcodes:
+                next_late_opcode += 1
+            opcode = str(base_opcodes + next_late_opcode)
+        else:
+            next_opcode += 1
+            opcode = str(next_opcode)
         if (int(opcode) > max_opcode):
             max_opcode = int(opcode)
 
@@ -592,6 +721,32 @@ if typegen == 'marshaller' or typegen == 'demarshaller':
     else:
         out.write('#include "waltham-server.h"\n\n')
 
+def count_element(elementname, attrs):
+    global base_opcodes
+
+    if elementname == "request" or elementname == "event":
+        if attrs.get('opcode') is not None:
+            fixed = int(attrs.get('opcode'))
+            if fixed in fixed_opcodes:
+                sys.exit('opcode {} is used twice'.format(fixed))
+            fixed_opcodes.add(fixed)
+        elif attrs.get('appended') != 'true':
+            base_opcodes += 1
+
+
+for x in input_files:
+    inputfile = open(x, 'rb')
+
+    p0 = xml.parsers.expat.ParserCreate()
+    p0.StartElementHandler = count_element
+
+    p0.ParseFile(inputfile)
+    inputfile.close()
+
+for x in fixed_opcodes:
+    if x <= base_opcodes:
+        sys.exit('opcode {} is taken by a message in document order'.format(x))
+
 for x in input_files:
     inputfile = open(x, 'rb')
 